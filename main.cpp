@@ -7,11 +7,14 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sched.h>
 #include <signal.h>
 #include <chrono>
 #include <cstdlib>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <cstring>
 #include <sys/statvfs.h>
 #include <thread>
@@ -22,616 +25,6289 @@
 #include <arpa/inet.h>
 #include <vector>
 #include <algorithm>
+#include <cmath>
 #include <queue>
+#include <alsa/asoundlib.h>
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+#include <memory>
+#include <condition_variable>
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <deque>
+#include <array>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <poll.h>
 
 // 全局变量
 std::atomic<bool> running(true);
-cv::Mat current_frame;
-std::mutex frame_mutex;
 std::string video_dir_global;
-pid_t audio_pid = -1;
 
-// 合成任务队列
-struct MergeTask {
-    std::string video_file;
-    std::string audio_file;
-    std::string output_file;
+// Web服务器配置
+int http_port = 6969;
+int http_backlog = 128;
+int http_max_connections = 256;
+int http_idle_timeout_sec = 30;
+
+// 已编码的JPEG帧（只读，由所有 /stream 客户端共享）
+struct JpegFrame {
+    std::vector<uchar> data;
+    uint64_t seq;
 };
 
-std::queue<MergeTask> merge_queue;
-std::mutex merge_queue_mutex;
-std::atomic<bool> is_merging(false);
+long futex_call(std::atomic<uint32_t>* addr, int op, uint32_t val, const struct timespec* timeout) {
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val, timeout, nullptr, 0);
+}
 
-// 文件信息结构体
-struct FileInfo {
-    std::string name;
-    std::string path;
-    long long size;
-    time_t mtime;
-    
-    bool operator<(const FileInfo& other) const {
-        return mtime > other.mtime;
+// 线程命名，top -H 和基准测试按线程名统计CPU（内核限制15个字符）
+void set_thread_name(const std::string& name) {
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+}
+
+// 采集线程与各消费者之间的无锁帧环形缓冲（单生产者/多消费者）
+// 槽位预先分配，每个槽位用序号锁保护：采集端只做一次memcpy，从不等待消费者；
+// 消费者读取时若槽位正被覆盖则读取失败，改读更新的帧即可
+struct FrameRing {
+    static const size_t SLOTS = 8;
+
+    struct Slot {
+        std::atomic<uint64_t> version{0};  // 2*seq 表示可读，奇数表示正在写入
+        std::atomic<size_t> size{0};
+        std::vector<uchar> data;
+    };
+
+    Slot slots[SLOTS];
+    size_t capacity;
+    std::atomic<uint64_t> published{0};   // 最新帧序号
+    std::atomic<uint32_t> futex_word{0};  // 每发布一帧加一，供等待者休眠
+    std::atomic<int> waiters{0};
+    std::atomic<int> notify_fd{-1};       // Web服务器的eventfd，有新帧时唤醒事件循环
+    std::atomic<uint64_t> oversized{0};
+
+    explicit FrameRing(size_t slot_capacity = 1024 * 1024) : capacity(slot_capacity) {
+        for (auto& slot : slots) slot.data.resize(capacity);
+    }
+
+    void publish(const uchar* data, size_t len) {
+        if (len > capacity) {
+            oversized++;
+            return;
+        }
+        uint64_t seq = published.load(std::memory_order_relaxed) + 1;
+        Slot& slot = slots[seq % SLOTS];
+        slot.version.store(seq * 2 - 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(slot.data.data(), data, len);
+        slot.size.store(len, std::memory_order_relaxed);
+        slot.version.store(seq * 2, std::memory_order_release);
+        published.store(seq, std::memory_order_release);
+
+        futex_word++;
+        if (waiters > 0) futex_call(&futex_word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr);
+        int fd = notify_fd;
+        if (fd >= 0) {
+            uint64_t one = 1;
+            ssize_t ret = write(fd, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+
+    uint64_t latest_seq() const {
+        return published.load(std::memory_order_acquire);
+    }
+
+    // 读取指定序号的帧，该槽位已被新帧覆盖时返回false
+    bool read(uint64_t seq, std::vector<uchar>& out) {
+        if (seq == 0) return false;
+        Slot& slot = slots[seq % SLOTS];
+        uint64_t version = slot.version.load(std::memory_order_acquire);
+        if (version != seq * 2) return false;
+        size_t size = slot.size.load(std::memory_order_relaxed);
+        out.resize(size);
+        memcpy(out.data(), slot.data.data(), size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.version.load(std::memory_order_relaxed) == version;
+    }
+
+    // 读取最新一帧，返回其序号（没有帧时返回0）
+    uint64_t read_latest(std::vector<uchar>& out) {
+        while (true) {
+            uint64_t seq = latest_seq();
+            if (seq == 0 || read(seq, out)) return seq;
+        }
+    }
+
+    // 等待序号大于 after 的新帧，返回最新序号；超时或退出时返回0
+    uint64_t wait_next(uint64_t after, int timeout_ms) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (running) {
+            uint32_t word = futex_word;
+            uint64_t seq = latest_seq();
+            if (seq > after) return seq;
+
+            auto remaining = deadline - std::chrono::steady_clock::now();
+            if (remaining <= std::chrono::steady_clock::duration::zero()) return 0;
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+            struct timespec ts = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+            waiters++;
+            futex_call(&futex_word, FUTEX_WAIT_PRIVATE, word, &ts);
+            waiters--;
+        }
+        return 0;
     }
 };
 
-long long get_free_disk_space(const std::string& path) {
-    struct statvfs buf;
-    if (statvfs(path.c_str(), &buf) != 0) return -1;
-    return (long long)buf.f_frsize * (long long)buf.f_bavail;
-}
+// 从MJPEG字节流中按SOI/EOI切分出完整的JPEG帧（不解码）
+struct JpegStreamParser {
+    std::vector<uchar> buf;
+    size_t scan = 0;          // 当前帧已解析到的位置，0表示还未找到SOI
+    bool in_entropy = false;  // 是否位于SOS之后的熵编码数据中
 
-long long get_total_disk_space(const std::string& path) {
-    struct statvfs buf;
-    if (statvfs(path.c_str(), &buf) != 0) return -1;
-    return (long long)buf.f_frsize * (long long)buf.f_blocks;
-}
+    void feed(const uchar* data, size_t len) {
+        buf.insert(buf.end(), data, data + len);
+        // 长时间找不到完整帧说明数据已损坏，丢弃重来
+        if (buf.size() > 16 * 1024 * 1024) {
+            buf.clear();
+            scan = 0;
+        }
+    }
 
-std::vector<FileInfo> get_video_files(const std::string& dir) {
-    std::vector<FileInfo> files;
-    DIR* d = opendir(dir.c_str());
-    if (!d) return files;
+    // 丢弃当前帧头，从下一个字节重新寻找SOI
+    void resync() {
+        buf.erase(buf.begin());
+        scan = 0;
+    }
 
-    struct dirent* entry;
-    while ((entry = readdir(d)) != nullptr) {
-        if (entry->d_type == DT_REG) {
-            std::string filename = entry->d_name;
-            if ((filename.length() > 4 && filename.substr(filename.length() - 4) == ".avi") ||
-                (filename.length() > 4 && filename.substr(filename.length() - 4) == ".wav") ||
-                (filename.length() > 4 && filename.substr(filename.length() - 4) == ".mp4")) {
-                std::string file_path = dir + "/" + filename;
-                struct stat file_stat;
-                if (stat(file_path.c_str(), &file_stat) == 0) {
-                    FileInfo info;
-                    info.name = filename;
-                    info.path = file_path;
-                    info.size = file_stat.st_size;
-                    info.mtime = file_stat.st_mtime;
-                    files.push_back(info);
+    // 取出下一帧完整JPEG，数据不足时返回false
+    bool next_frame(std::vector<uchar>& frame) {
+        while (true) {
+            if (scan == 0) {
+                size_t i = 0;
+                while (i + 1 < buf.size() && !(buf[i] == 0xFF && buf[i + 1] == 0xD8)) i++;
+                if (i > 0) buf.erase(buf.begin(), buf.begin() + i);
+                if (buf.size() < 2) return false;
+                scan = 2;
+                in_entropy = false;
+            }
+
+            if (!in_entropy) {
+                // 按段长度跳过标记段，直到SOS
+                bool bad = false;
+                while (!in_entropy) {
+                    if (scan + 2 > buf.size()) return false;
+                    if (buf[scan] != 0xFF) { bad = true; break; }
+                    uchar marker = buf[scan + 1];
+                    if (marker == 0xFF) { scan++; continue; }
+                    if (marker == 0xD9) return emit(frame, scan + 2);
+                    if (marker == 0xD8) { bad = true; break; }
+                    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { scan += 2; continue; }
+                    if (scan + 4 > buf.size()) return false;
+                    size_t seg_len = (buf[scan + 2] << 8) | buf[scan + 3];
+                    if (seg_len < 2) { bad = true; break; }
+                    if (scan + 2 + seg_len > buf.size()) return false;
+                    scan += 2 + seg_len;
+                    if (marker == 0xDA) in_entropy = true;
+                }
+                if (bad) {
+                    resync();
+                    continue;
+                }
+            }
+
+            // 熵编码数据中只有 FF00 填充和 RSTn，其余标记表示扫描段结束
+            while (true) {
+                const uchar* start = buf.data() + scan;
+                const uchar* ff = (const uchar*)memchr(start, 0xFF, buf.size() - scan);
+                if (!ff) {
+                    scan = buf.size();
+                    return false;
+                }
+                scan = ff - buf.data();
+                if (scan + 1 >= buf.size()) return false;
+                uchar marker = buf[scan + 1];
+                if (marker == 0x00 || (marker >= 0xD0 && marker <= 0xD7)) {
+                    scan += 2;
+                } else if (marker == 0xFF) {
+                    scan++;
+                } else if (marker == 0xD9) {
+                    return emit(frame, scan + 2);
+                } else {
+                    // 渐进式JPEG的下一个扫描段等，回到标记段解析
+                    in_entropy = false;
+                    break;
                 }
             }
         }
     }
-    closedir(d);
-    std::sort(files.begin(), files.end());
-    return files;
+
+    bool emit(std::vector<uchar>& frame, size_t end) {
+        frame.assign(buf.begin(), buf.begin() + end);
+        buf.erase(buf.begin(), buf.begin() + end);
+        scan = 0;
+        in_entropy = false;
+        return true;
+    }
+};
+
+// 从JPEG的SOF标记段读出图像尺寸，不解码；遇到SOS之前没有SOF或数据不完整时返回false
+bool jpeg_frame_size(const std::vector<uchar>& jpeg, int& width, int& height) {
+    if (jpeg.size() < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) return false;
+    size_t pos = 2;
+    while (pos + 4 <= jpeg.size()) {
+        if (jpeg[pos] != 0xFF) return false;
+        uchar marker = jpeg[pos + 1];
+        if (marker == 0xFF) { pos++; continue; }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { pos += 2; continue; }
+        if (marker == 0xDA || marker == 0xD9) return false;
+        size_t seg_len = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+        if (seg_len < 2) return false;
+        // SOF0～SOF15，除去 DHT(C4)、JPG(C8)、DAC(CC)
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (seg_len < 7 || pos + 9 > jpeg.size()) return false;
+            height = (jpeg[pos + 5] << 8) | jpeg[pos + 6];
+            width = (jpeg[pos + 7] << 8) | jpeg[pos + 8];
+            return width > 0 && height > 0;
+        }
+        pos += 2 + seg_len;
+    }
+    return false;
 }
 
-std::string get_oldest_file(const std::string& dir) {
-    std::vector<FileInfo> files = get_video_files(dir);
-    if (files.empty()) return "";
-    return files.back().path;
+// EBML/Matroska 编码辅助函数
+void ebml_put_id(std::vector<uchar>& out, uint32_t id) {
+    if (id >= 0x1000000) out.push_back(id >> 24);
+    if (id >= 0x10000) out.push_back(id >> 16);
+    if (id >= 0x100) out.push_back(id >> 8);
+    out.push_back(id);
 }
 
-std::string format_size(long long bytes) {
-    if (bytes < 1024) return std::to_string(bytes) + " B";
-    if (bytes < 1024 * 1024) return std::to_string(bytes / 1024) + " KB";
-    if (bytes < 1024 * 1024 * 1024) return std::to_string(bytes / 1024 / 1024) + " MB";
-    return std::to_string(bytes / 1024 / 1024 / 1024) + " GB";
+void ebml_put_size(std::vector<uchar>& out, uint64_t size) {
+    int len = 1;
+    while (len < 8 && size >= (1ULL << (7 * len)) - 1) len++;
+    for (int i = len - 1; i >= 0; i--) {
+        uchar b = size >> (8 * i);
+        if (i == len - 1) b |= 0x80 >> (len - 1);
+        out.push_back(b);
+    }
 }
 
-std::string format_time(time_t t) {
-    char buf[64];
-    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", std::localtime(&t));
-    return std::string(buf);
+// 固定8字节长度，便于事后回填
+void ebml_put_size8(std::vector<uchar>& out, uint64_t size) {
+    out.push_back(0x01);
+    for (int i = 6; i >= 0; i--) out.push_back(size >> (8 * i));
 }
 
-void ensure_disk_space(const std::string& dir, long long min_space_bytes) {
-    int deleted_count = 0;
-    
-    while (deleted_count < 20) {
-        long long free_space = get_free_disk_space(dir);
-        if (free_space >= min_space_bytes) break;
-        
-        std::string oldest = get_oldest_file(dir);
-        if (oldest.empty()) break;
+void ebml_put_uint(std::vector<uchar>& out, uint32_t id, uint64_t value) {
+    int len = 1;
+    while (len < 8 && (value >> (8 * len))) len++;
+    ebml_put_id(out, id);
+    ebml_put_size(out, len);
+    for (int i = len - 1; i >= 0; i--) out.push_back(value >> (8 * i));
+}
+
+void ebml_put_float(std::vector<uchar>& out, uint32_t id, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    ebml_put_id(out, id);
+    ebml_put_size(out, 8);
+    for (int i = 7; i >= 0; i--) out.push_back(bits >> (8 * i));
+}
+
+void ebml_put_string(std::vector<uchar>& out, uint32_t id, const std::string& value) {
+    ebml_put_id(out, id);
+    ebml_put_size(out, value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+void ebml_put_master(std::vector<uchar>& out, uint32_t id, const std::vector<uchar>& body) {
+    ebml_put_id(out, id);
+    ebml_put_size(out, body.size());
+    out.insert(out.end(), body.begin(), body.end());
+}
+
+void put_be64(uchar* p, uint64_t value) {
+    for (int i = 0; i < 8; i++) p[i] = value >> (8 * (7 - i));
+}
+
+// 读取 EBML ID（保留长度标记位），返回占用的字节数，数据不完整或非法时返回0
+size_t ebml_read_id(const uchar* p, size_t len, uint32_t& id) {
+    if (len == 0 || p[0] == 0) return 0;
+    size_t n = 1;
+    while (n <= 4 && !(p[0] & (0x80 >> (n - 1)))) n++;
+    if (n > 4 || n > len) return 0;
+    id = 0;
+    for (size_t i = 0; i < n; i++) id = (id << 8) | p[i];
+    return n;
+}
+
+// 读取 EBML 长度，未知长度返回 UINT64_MAX
+size_t ebml_read_size(const uchar* p, size_t len, uint64_t& size) {
+    if (len == 0 || p[0] == 0) return 0;
+    size_t n = 1;
+    while (!(p[0] & (0x80 >> (n - 1)))) n++;
+    if (n > len) return 0;
+    size = p[0] & (0xFF >> n);
+    bool unknown = size == (0xFFu >> n);
+    for (size_t i = 1; i < n; i++) {
+        size = (size << 8) | p[i];
+        unknown = unknown && p[i] == 0xFF;
+    }
+    if (unknown) size = UINT64_MAX;
+    return n;
+}
+
+// 录像的簇索引文件：与录像同目录的隐藏文件 .<文件名>.idx
+std::string segment_index_path(const std::string& video_path) {
+    size_t slash = video_path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : video_path.substr(0, slash);
+    return dir + "/." + video_path.substr(slash + 1) + ".idx";
+}
+
+int64_t steady_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t wall_clock_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// 运行指标，/metrics 以 Prometheus 文本格式输出
+// 计数按线程分片累加：每个线程只写自己缓存行上的 relaxed 原子变量，抓取时才汇总，热路径开销为几纳秒
+const int METRIC_SHARDS = 8;
+std::atomic<int> metric_next_shard{0};
+
+inline int metric_shard() {
+    thread_local int shard = metric_next_shard++ % METRIC_SHARDS;
+    return shard;
+}
+
+inline uint64_t metric_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct MetricFamily;
+std::vector<MetricFamily*>& metric_registry() {
+    static std::vector<MetricFamily*> families;
+    return families;
+}
+
+struct MetricFamily {
+    std::string name;
+    std::string help;
+    MetricFamily(const std::string& metric_name, const std::string& metric_help) : name(metric_name), help(metric_help) {
+        metric_registry().push_back(this);
+    }
+    virtual ~MetricFamily() {}
+    virtual void render(std::ostringstream& out) = 0;
+};
+
+void metric_write_header(std::ostringstream& out, const std::string& name, const std::string& help, const char* type) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+// 默认6位有效数字会把磁盘字节数截断，按15位输出
+std::string metric_format(double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", value);
+    return buf;
+}
+
+void metric_write_gauge(std::ostringstream& out, const std::string& name, const std::string& help, double value) {
+    metric_write_header(out, name, help, "gauge");
+    out << name << " " << metric_format(value) << "\n";
+}
+
+// counts 为各区间的计数（非累积），最后一项为超出上界的部分
+void metric_write_histogram(std::ostringstream& out, const std::string& name, const std::string& help,
+                            const std::vector<double>& bounds, const std::vector<uint64_t>& counts, double sum) {
+    metric_write_header(out, name, help, "histogram");
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < bounds.size(); i++) {
+        cumulative += counts[i];
+        out << name << "_bucket{le=\"" << bounds[i] << "\"} " << cumulative << "\n";
+    }
+    cumulative += counts[bounds.size()];
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+    out << name << "_sum " << metric_format(sum) << "\n" << name << "_count " << cumulative << "\n";
+}
+
+struct alignas(64) MetricCounterShard {
+    std::atomic<uint64_t> value{0};
+};
+
+struct MetricCounter : MetricFamily {
+    MetricCounterShard shards[METRIC_SHARDS];
+
+    MetricCounter(const std::string& metric_name, const std::string& metric_help) : MetricFamily(metric_name, metric_help) {}
+
+    void add(uint64_t n = 1) {
+        shards[metric_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (const auto& shard : shards) sum += shard.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    void render(std::ostringstream& out) override {
+        metric_write_header(out, name, help, "counter");
+        out << name << " " << total() << "\n";
+    }
+};
+
+// 耗时直方图，观测值单位纳秒，输出单位秒
+const std::vector<double> metric_latency_bounds = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+                                                   0.05, 0.1, 0.25, 0.5, 1, 2.5, 5};
+const int METRIC_MAX_BUCKETS = 16;
+
+struct alignas(64) MetricHistogramShard {
+    std::atomic<uint64_t> counts[METRIC_MAX_BUCKETS + 1];
+    std::atomic<uint64_t> sum_ns{0};
+    MetricHistogramShard() {
+        for (auto& count : counts) count = 0;
+    }
+};
+
+struct MetricHistogram : MetricFamily {
+    std::vector<double> bounds;
+    uint64_t bounds_ns[METRIC_MAX_BUCKETS];
+    MetricHistogramShard shards[METRIC_SHARDS];
+
+    MetricHistogram(const std::string& metric_name, const std::string& metric_help,
+                    const std::vector<double>& bucket_bounds = metric_latency_bounds)
+        : MetricFamily(metric_name, metric_help), bounds(bucket_bounds) {
+        if (bounds.size() > METRIC_MAX_BUCKETS) bounds.resize(METRIC_MAX_BUCKETS);
+        for (size_t i = 0; i < bounds.size(); i++) bounds_ns[i] = (uint64_t)(bounds[i] * 1e9);
+    }
+
+    void observe_ns(uint64_t ns) {
+        size_t bucket = 0;
+        while (bucket < bounds.size() && ns > bounds_ns[bucket]) bucket++;
+        MetricHistogramShard& shard = shards[metric_shard()];
+        shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        shard.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // 记录从 begin_ns 到现在的耗时
+    void observe_since(uint64_t begin_ns) {
+        observe_ns(metric_now_ns() - begin_ns);
+    }
+
+    // 汇总各分片：counts 比 bounds 多一个 +Inf 桶
+    void snapshot(std::vector<uint64_t>& counts, uint64_t& sum_ns) const {
+        counts.assign(bounds.size() + 1, 0);
+        sum_ns = 0;
+        for (const auto& shard : shards) {
+            for (size_t i = 0; i <= bounds.size(); i++) counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+            sum_ns += shard.sum_ns.load(std::memory_order_relaxed);
+        }
+    }
+
+    void render(std::ostringstream& out) override {
+        std::vector<uint64_t> counts;
+        uint64_t sum_ns;
+        snapshot(counts, sum_ns);
+        metric_write_histogram(out, name, help, bounds, counts, sum_ns / 1e9);
+    }
+};
+
+// 采集主循环
+MetricCounter metric_frames_captured("recorder_frames_captured_total", "Frames read from the camera");
+MetricCounter metric_frames_dropped("recorder_frames_dropped_total", "Camera frames dropped because they could not be decoded");
+MetricHistogram metric_frame_read("recorder_frame_read_seconds", "Time spent reading and parsing one camera frame");
+MetricHistogram metric_frame_decode("recorder_frame_decode_seconds", "JPEG decode time per frame");
+MetricHistogram metric_frame_overlay("recorder_frame_overlay_seconds", "Timestamp overlay and JPEG re-encode time per frame");
+MetricHistogram metric_frame_encode("recorder_frame_encode_seconds", "H.264 encode time per frame");
+MetricHistogram metric_frame_write("recorder_frame_write_seconds", "Time to mux one packet and hand it to the writer thread");
+MetricHistogram metric_capture_first_frame("recorder_capture_first_frame_seconds", "Time from starting a camera source to its first complete frame");
+MetricHistogram metric_capture_outage("recorder_capture_outage_seconds", "Time from the last frame before a source failure to the first frame after recovery",
+                                      {0.25, 0.5, 1, 2, 5, 10, 30, 60, 120, 300, 600});
+MetricCounter metric_capture_restarts("recorder_capture_restarts_total", "Camera source restarts after a crash, stall or open failure");
+
+// HTTP
+MetricCounter metric_http_requests("recorder_http_requests_total", "HTTP requests handled");
+MetricHistogram metric_http_request("recorder_http_request_seconds", "Time to route one HTTP request and build its response");
+MetricCounter metric_http_sent_bytes("recorder_http_sent_bytes_total", "Bytes sent to HTTP clients, including streams and downloads");
+MetricCounter metric_stream_frames_sent("recorder_stream_frames_sent_total", "Live stream frames queued to viewers");
+MetricCounter metric_stream_frames_dropped("recorder_stream_frames_dropped_total", "Live stream frames skipped because the viewer was still busy");
+
+// 后台任务与清理
+MetricCounter metric_jobs_done("recorder_jobs_done_total", "Background jobs that finished successfully");
+MetricCounter metric_jobs_failed("recorder_jobs_failed_total", "Background jobs that failed");
+MetricHistogram metric_job_duration("recorder_job_duration_seconds", "Background job run time",
+                                    {1, 5, 10, 30, 60, 120, 300, 600, 1200, 1800, 3600, 7200});
+MetricCounter metric_retention_deleted("recorder_retention_deleted_files_total", "Recordings deleted by the retention policy");
+MetricCounter metric_retention_freed("recorder_retention_freed_bytes_total", "Bytes freed by the retention policy");
+
+// 按采集时间戳封装时的帧位与音频校正
+MetricCounter metric_frames_duplicated("recorder_frames_duplicated_total", "Recorded frames repeated to fill gaps left by late or missing camera frames");
+MetricCounter metric_frames_paced_out("recorder_frames_paced_out_total", "Camera frames not recorded because an earlier frame already filled their slot");
+MetricCounter metric_audio_padded("recorder_audio_padded_samples_total", "Silent audio samples inserted because audio fell behind the capture clock");
+MetricHistogram metric_audio_encode("recorder_audio_encode_seconds", "Time to meter, encode and mux one 100 ms audio block");
+MetricCounter metric_audio_trimmed("recorder_audio_trimmed_samples_total", "Audio samples dropped because audio ran ahead of the capture clock");
+
+// 音视频实时封装为Matroska（MJPEG或H.264视频 + PCM音频），录制即成品，无需事后合成
+// 每个簇从视频关键帧开始、约1秒，整簇写入；断电时已写入的簇仍可播放
+// 打开中的录像日志：录像目录下的 .journal，每行一个未正常关闭的文件，启动时据此修复
+std::mutex segment_journal_mutex;
+
+void segment_journal_update(const std::string& path, bool opened) {
+    std::lock_guard<std::mutex> lock(segment_journal_mutex);
+    size_t slash = path.rfind('/');
+    std::string journal = (slash == std::string::npos ? "." : path.substr(0, slash)) + "/.journal";
+
+    std::vector<std::string> entries;
+    std::ifstream in(journal);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line != path) entries.push_back(line);
+    }
+    in.close();
+    if (opened) entries.push_back(path);
+
+    // 先写临时文件并落盘再改名，断电时日志要么是旧的要么是新的
+    std::string tmp_path = journal + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    std::string data;
+    for (const auto& entry : entries) data += entry + "\n";
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size() && fdatasync(fd) == 0;
+    close(fd);
+    if (ok) rename(tmp_path.c_str(), journal.c_str());
+}
+
+// 录像写盘线程：采集线程只把封装好的整簇放入有界队列，写盘和落盘在独立线程完成
+// 小块数据先拼进对齐的大缓冲区，攒满一块（默认1MB）才 pwrite 一次，SD卡上大块顺序写远比零碎写快
+// 可选 O_DIRECT 绕过页缓存，避免脏页回写时的长时间卡顿；尾部不足一个对齐块时暂用普通写入并保留在缓冲区
+const size_t STORAGE_ALIGN = 4096;
+const int STORAGE_LATENCY_BUCKETS = 12;
+const int storage_latency_bounds_ms[STORAGE_LATENCY_BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000};
+
+struct StorageFile {
+    std::string path;
+    int fd = -1;
+    int index_fd = -1;
+    bool direct = false;
+    std::atomic<bool> failed{false};  // 写盘线程置位，采集线程据此提前切换文件
+    uchar* staging = nullptr;        // 对齐缓冲区，首字节对应文件中的 staging_pos
+    size_t staging_len = 0;
+    long long staging_pos = 0;
+};
+
+struct StorageOp {
+    enum Kind { APPEND, PATCH, SYNC, CLOSE };
+    std::shared_ptr<StorageFile> file;
+    Kind kind;
+    std::vector<uchar> data;
+    long long pos = 0;
+    std::string index;               // 数据落盘后追加到索引文件的行
+};
+
+struct StorageWriter {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<StorageOp> queue;
+    std::thread worker;
+    bool stopping = false;
+    size_t queued_bytes = 0;         // 含正在写的一项，反映存储的积压
+    size_t max_queue_bytes = 16 * 1024 * 1024;
+    size_t chunk_size = 1024 * 1024;
+    bool direct_io = false;
+    bool null_sink = false;          // 基准测试：数据照常排队、缓冲和写出，但写到 /dev/null
+
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> syncs{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> dropped_clusters{0};
+    std::atomic<uint64_t> dropped_bytes{0};
+    std::atomic<uint64_t> queue_peak{0};
+    std::atomic<uint64_t> write_rate{0};  // 最近一秒的写入速率（字节/秒）
+    std::array<std::atomic<uint64_t>, STORAGE_LATENCY_BUCKETS> write_latency{};
+    std::array<std::atomic<uint64_t>, STORAGE_LATENCY_BUCKETS> sync_latency{};
+    std::atomic<uint64_t> write_latency_sum_ms{0};
+    std::atomic<uint64_t> sync_latency_sum_ms{0};
+    int64_t rate_window_start = 0;
+    uint64_t rate_window_bytes = 0;
+
+    void start() {
+        chunk_size = std::max(STORAGE_ALIGN, chunk_size / STORAGE_ALIGN * STORAGE_ALIGN);
+        stopping = false;
+        worker = std::thread(&StorageWriter::run, this);
+        std::cout << "✓ 写盘线程已启动（块大小 " << chunk_size / 1024 << "KB，队列上限 "
+                  << max_queue_bytes / 1024 / 1024 << "MB" << (direct_io ? "，O_DIRECT" : "") << "）" << std::endl;
+    }
+
+    // 等队列写完再退出，关闭中的录像必须完整落盘
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    std::shared_ptr<StorageFile> open(const std::string& path, const std::string& index_header) {
+        auto file = std::make_shared<StorageFile>();
+        file->path = path;
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        if (null_sink) file->fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+        else if (direct_io) {
+            file->fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            file->direct = file->fd >= 0;
+        }
+        // tmpfs 等文件系统不支持 O_DIRECT，退回普通写入
+        if (file->fd < 0) file->fd = ::open(path.c_str(), flags, 0644);
+        if (file->fd < 0) return nullptr;
+        void* buf = nullptr;
+        if (posix_memalign(&buf, STORAGE_ALIGN, chunk_size) != 0) {
+            ::close(file->fd);
+            return nullptr;
+        }
+        file->staging = (uchar*)buf;
+        if (null_sink) return file;
+        file->index_fd = ::open(segment_index_path(path).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (file->index_fd >= 0 && write(file->index_fd, index_header.data(), index_header.size()) < 0) {
+            ::close(file->index_fd);
+            file->index_fd = -1;
+        }
+        return file;
+    }
+
+    // force 为 false 时队列满则拒绝，由调用方丢帧；文件头、索引和关闭操作必须写入
+    bool submit(StorageOp op, bool force) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!force && queued_bytes + op.data.size() > max_queue_bytes) return false;
+            queued_bytes += op.data.size();
+            if (queued_bytes > queue_peak) queue_peak = queued_bytes;
+            queue.push_back(std::move(op));
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    bool append(const std::shared_ptr<StorageFile>& file, std::vector<uchar> data, bool force) {
+        StorageOp op;
+        op.file = file;
+        op.kind = StorageOp::APPEND;
+        op.data = std::move(data);
+        return submit(std::move(op), force);
+    }
+
+    void patch(const std::shared_ptr<StorageFile>& file, long long pos, const uchar* data, size_t len) {
+        StorageOp op;
+        op.file = file;
+        op.kind = StorageOp::PATCH;
+        op.pos = pos;
+        op.data.assign(data, data + len);
+        submit(std::move(op), true);
+    }
+
+    void sync(const std::shared_ptr<StorageFile>& file, const std::string& index, bool close_after) {
+        StorageOp op;
+        op.file = file;
+        op.kind = close_after ? StorageOp::CLOSE : StorageOp::SYNC;
+        op.index = index;
+        submit(std::move(op), true);
+    }
+
+    size_t backlog() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queued_bytes;
+    }
+
+    static void record_latency(std::array<std::atomic<uint64_t>, STORAGE_LATENCY_BUCKETS>& histogram,
+                               std::atomic<uint64_t>& sum_ms, int64_t ms) {
+        int bucket = 0;
+        while (bucket < STORAGE_LATENCY_BUCKETS - 1 && ms > storage_latency_bounds_ms[bucket]) bucket++;
+        histogram[bucket]++;
+        sum_ms += ms;
+    }
+
+    void set_direct(StorageFile& file, bool on) {
+        int flags = fcntl(file.fd, F_GETFL);
+        if (flags >= 0) fcntl(file.fd, F_SETFL, on ? (flags | O_DIRECT) : (flags & ~O_DIRECT));
+    }
+
+    void write_at(StorageFile& file, const uchar* data, size_t len, long long pos) {
+        if (file.failed) return;
+        int64_t begin = steady_ms();
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pwrite(file.fd, data + done, len - done, pos + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                std::cerr << "✗ 写入录像失败 " << file.path << ": " << strerror(errno) << std::endl;
+                file.failed = true;
+                errors++;
+                return;
+            }
+            done += n;
+        }
+        record_latency(write_latency, write_latency_sum_ms, steady_ms() - begin);
+        writes++;
+        bytes_written += len;
+    }
+
+    // 写出缓冲区中完整的对齐块；tail 为 true 时连不足一块的尾部也写出
+    void flush_staging(StorageFile& file, bool tail) {
+        size_t aligned = file.staging_len / STORAGE_ALIGN * STORAGE_ALIGN;
+        if (aligned > 0) {
+            write_at(file, file.staging, aligned, file.staging_pos);
+            memmove(file.staging, file.staging + aligned, file.staging_len - aligned);
+            file.staging_pos += aligned;
+            file.staging_len -= aligned;
+        }
+        if (!tail || file.staging_len == 0) return;
+        if (!file.direct) {
+            write_at(file, file.staging, file.staging_len, file.staging_pos);
+            file.staging_pos += file.staging_len;
+            file.staging_len = 0;
+            return;
+        }
+        // O_DIRECT 下尾部用普通写入，数据留在缓冲区，凑满一块后按对齐位置整块重写
+        set_direct(file, false);
+        write_at(file, file.staging, file.staging_len, file.staging_pos);
+        set_direct(file, true);
+    }
+
+    void process(StorageOp& op) {
+        StorageFile& file = *op.file;
+        if (op.kind == StorageOp::APPEND) {
+            size_t offset = 0;
+            while (offset < op.data.size()) {
+                size_t n = std::min(chunk_size - file.staging_len, op.data.size() - offset);
+                memcpy(file.staging + file.staging_len, op.data.data() + offset, n);
+                file.staging_len += n;
+                offset += n;
+                if (file.staging_len == chunk_size) flush_staging(file, false);
+            }
+        } else if (op.kind == StorageOp::PATCH) {
+            flush_staging(file, true);
+            // 回填位置若还在缓冲区里，同时改缓冲区，否则之后整块重写会覆盖回填
+            long long end = op.pos + (long long)op.data.size();
+            long long overlap_begin = std::max(op.pos, file.staging_pos);
+            long long overlap_end = std::min(end, file.staging_pos + (long long)file.staging_len);
+            if (overlap_begin < overlap_end) {
+                memcpy(file.staging + (overlap_begin - file.staging_pos), op.data.data() + (overlap_begin - op.pos),
+                       overlap_end - overlap_begin);
+            }
+            if (file.direct) set_direct(file, false);
+            write_at(file, op.data.data(), op.data.size(), op.pos);
+            if (file.direct) set_direct(file, true);
+        } else {
+            // 先同步录像数据，再追加对应的索引行，索引中的簇在断电后一定完整
+            flush_staging(file, true);
+            int64_t begin = steady_ms();
+            fdatasync(file.fd);
+            record_latency(sync_latency, sync_latency_sum_ms, steady_ms() - begin);
+            syncs++;
+            if (file.index_fd >= 0 && !op.index.empty() && !file.failed) {
+                if (write(file.index_fd, op.index.data(), op.index.size()) == (ssize_t)op.index.size()) {
+                    fdatasync(file.index_fd);
+                }
+            }
+            if (op.kind == StorageOp::CLOSE) {
+                ::close(file.fd);
+                file.fd = -1;
+                if (file.index_fd >= 0) ::close(file.index_fd);
+                file.index_fd = -1;
+                free(file.staging);
+                file.staging = nullptr;
+                // 写入失败（多为磁盘已满）的文件尾部不完整，留在日志中由下次启动修复
+                if (!file.failed) segment_journal_update(file.path, false);
+            }
+        }
+    }
+
+    void run() {
+        set_thread_name("storage");
+        rate_window_start = steady_ms();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait_for(lock, std::chrono::seconds(1), [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                if (stopping) break;
+            } else {
+                StorageOp op = std::move(queue.front());
+                queue.pop_front();
+                lock.unlock();
+                process(op);
+                lock.lock();
+                queued_bytes -= op.data.size();
+            }
+            int64_t now = steady_ms();
+            if (now - rate_window_start >= 1000) {
+                uint64_t total = bytes_written;
+                write_rate = (total - rate_window_bytes) * 1000 / (now - rate_window_start);
+                rate_window_bytes = total;
+                rate_window_start = now;
+            }
+        }
+    }
+};
+
+StorageWriter storage_writer;
+
+// 录像音频编码（libavcodec）：aac / flac / opus，打不开时退回未压缩 PCM
+std::string audio_codec = "aac";
+int audio_bitrate = 96000;              // aac / opus 码率，flac 无损不用
+
+// 编码后的音频包，pts 为包内第一个样本在音频轨中的位置（样本数）
+struct AudioPacket {
+    int64_t pts = 0;
+    std::vector<uchar> data;
+};
+
+// 交错的16位 PCM 按编码器帧长攒够一帧送编码，样本位置不连续时先把残余补零编出
+struct AudioEncoder {
+    AVCodecContext* ctx = nullptr;
+    AVFrame* frame = nullptr;
+    AVPacket* pkt = nullptr;
+    std::string codec_id;               // Matroska CodecID
+    std::vector<uchar> codec_private;
+    int channels = 0;
+    int frame_size = 0;
+    int padding = 0;                    // 编码器开头的预热样本数，写入 CodecDelay
+    std::vector<int16_t> pending;       // 不足一帧的样本
+    int64_t pending_pts = 0;
+
+    bool open(const std::string& name, int sample_rate, int channel_count, int bitrate) {
+        close();
+        std::string encoder_name = name == "opus" ? "libopus" : name;
+        const AVCodec* codec = avcodec_find_encoder_by_name(encoder_name.c_str());
+        if (!codec) return false;
+        ctx = avcodec_alloc_context3(codec);
+        if (!ctx) return false;
+        ctx->sample_rate = sample_rate;
+        ctx->sample_fmt = name == "aac" ? AV_SAMPLE_FMT_FLTP : AV_SAMPLE_FMT_S16;
+        av_channel_layout_default(&ctx->ch_layout, channel_count);
+        ctx->time_base = AVRational{1, sample_rate};
+        if (name != "flac") ctx->bit_rate = bitrate;
+        ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        if (avcodec_open2(ctx, codec, nullptr) < 0) {
+            avcodec_free_context(&ctx);
+            return false;
+        }
+        channels = channel_count;
+        frame_size = ctx->frame_size > 0 ? ctx->frame_size : 1024;
+        padding = ctx->initial_padding;
+        codec_private.clear();
+        if (name == "aac") {
+            codec_id = "A_AAC";
+            codec_private.assign(ctx->extradata, ctx->extradata + ctx->extradata_size);
+        } else if (name == "opus") {
+            codec_id = "A_OPUS";
+            codec_private.assign(ctx->extradata, ctx->extradata + ctx->extradata_size);
+        } else if (name == "flac") {
+            // Matroska 要求完整的 FLAC 头：标记 + 最后一个元数据块（STREAMINFO）
+            codec_id = "A_FLAC";
+            if (ctx->extradata_size >= 34) {
+                codec_private = {'f', 'L', 'a', 'C', 0x80, 0x00, 0x00, 0x22};
+                codec_private.insert(codec_private.end(), ctx->extradata, ctx->extradata + 34);
+            }
+        } else {
+            close();
+            return false;
+        }
+
+        frame = av_frame_alloc();
+        frame->format = ctx->sample_fmt;
+        frame->nb_samples = frame_size;
+        frame->sample_rate = sample_rate;
+        av_channel_layout_default(&frame->ch_layout, channel_count);
+        if (av_frame_get_buffer(frame, 0) < 0) {
+            close();
+            return false;
+        }
+        pkt = av_packet_alloc();
+        pending.clear();
+        pending_pts = 0;
+        return true;
+    }
+
+    bool is_opened() const { return ctx != nullptr; }
+
+    void receive_packets(std::vector<AudioPacket>& out) {
+        while (avcodec_receive_packet(ctx, pkt) == 0) {
+            AudioPacket packet;
+            packet.pts = pkt->pts + padding;
+            packet.data.assign(pkt->data, pkt->data + pkt->size);
+            av_packet_unref(pkt);
+            out.push_back(std::move(packet));
+        }
+    }
+
+    // 把 pending 开头的一帧送入编码器（不足补零）
+    void encode_frame(std::vector<AudioPacket>& out) {
+        size_t count = std::min<size_t>(frame_size, pending.size() / channels);
+        if (av_frame_make_writable(frame) < 0) return;
+        const int16_t* src = pending.data();
+        if (ctx->sample_fmt == AV_SAMPLE_FMT_FLTP) {
+            for (int c = 0; c < channels; c++) {
+                float* dst = (float*)frame->data[c];
+                for (size_t i = 0; i < count; i++) dst[i] = src[i * channels + c] / 32768.0f;
+                std::fill(dst + count, dst + frame_size, 0.0f);
+            }
+        } else {
+            int16_t* dst = (int16_t*)frame->data[0];
+            memcpy(dst, src, count * channels * sizeof(int16_t));
+            std::fill(dst + count * channels, dst + (size_t)frame_size * channels, 0);
+        }
+        frame->pts = pending_pts;
+        pending.erase(pending.begin(), pending.begin() + count * channels);
+        pending_pts += frame_size;
+        if (avcodec_send_frame(ctx, frame) == 0) receive_packets(out);
+    }
+
+    // pts 为 samples 第一个样本在音频轨中的位置
+    void encode(const int16_t* samples, size_t frames, int64_t pts, std::vector<AudioPacket>& out) {
+        if (!pending.empty() && pts != pending_pts + (int64_t)(pending.size() / channels)) encode_frame(out);
+        if (pending.empty()) pending_pts = pts;
+        pending.insert(pending.end(), samples, samples + frames * channels);
+        while (pending.size() >= (size_t)frame_size * channels) encode_frame(out);
+    }
+
+    // 文件结束：编出残余样本并取出编码器中缓存的包，之后需重新 open
+    void flush(std::vector<AudioPacket>& out) {
+        if (!ctx) return;
+        if (!pending.empty()) encode_frame(out);
+        if (avcodec_send_frame(ctx, nullptr) == 0) receive_packets(out);
+    }
+
+    void close() {
+        if (pkt) av_packet_free(&pkt);
+        if (frame) av_frame_free(&frame);
+        if (ctx) avcodec_free_context(&ctx);
+        pending.clear();
+    }
+
+    ~AudioEncoder() { close(); }
+};
+
+struct MkvWriter {
+    static const int VIDEO_TRACK = 1;
+    static const int AUDIO_TRACK = 2;
+
+    std::mutex mutex;
+    std::shared_ptr<StorageFile> file;
+    int fps = 20;
+    int audio_rate = 0;
+    int audio_channels = 0;
+    uint64_t video_frames = 0;
+    uint64_t audio_samples = 0;       // 音频轨已写到的样本位置（含校正）
+    bool audio_started = false;
+    AudioEncoder audio_encoder;       // 未打开时音频轨为未压缩 PCM
+    std::vector<AudioPacket> audio_packets;
+    int64_t last_ts = 0;
+    int64_t base_ms = 0;              // 时间戳0对应的单调时钟时刻，音视频共用
+    int64_t video_slot = -1;          // 上一帧所在的帧位（按标称帧率划分的时间格）
+    bool all_keyframes = false;       // MJPEG：每帧独立，可丢帧或重复帧
+    std::vector<uchar> last_video;    // 上一帧数据，用于补帧
+    long long segment_size_pos = 0;   // Segment 长度字段位置
+    long long segment_data_pos = 0;   // Segment 内容起始位置，簇位置以此为基准
+    long long cues_seek_pos = 0;      // SeekHead 中 Cues 位置字段
+    long long duration_pos = 0;       // Info 中 Duration 字段
+    long long write_pos = 0;
+    std::vector<uchar> cluster;       // 当前簇内容（不含簇头）
+    int64_t cluster_ts = -1;
+    bool cluster_cue = false;         // 当前簇是否以视频关键帧开始
+    std::vector<std::pair<int64_t, long long>> cues;  // (时间戳, 簇位置)
+    std::string path;
+    int sync_interval_ms = 5000;      // 每隔多久把数据落盘，断电最多丢失这么久的录像
+    int64_t last_sync_ms = 0;
+    std::string pending_index;        // 尚未落盘的簇对应的索引行（.idx），数据落盘后才写入索引
+    bool dropping = false;            // 存储跟不上时丢簇，直到下一个视频关键帧开始的簇
+    uint64_t dropped_in_run = 0;
+
+    // codec_id 为 "V_MJPEG" 或 "V_MPEG4/ISO/AVC"（codec_private 为 avcC）；sample_rate 为 0 时只写视频轨
+    // start_ms：时间戳0对应的单调时钟时刻，即第一帧（含预录）的采集时间
+    bool open(const std::string& file_path, int width, int height, int frame_rate,
+              const std::string& codec_id, const std::vector<uchar>& codec_private,
+              int sample_rate, int channels, int64_t start_ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        close_locked();
+        path = file_path;
+        // 时间戳0对应的墙上时间：预录部分在打开文件之前
+        file = storage_writer.open(path, "start\t" + std::to_string(wall_clock_ms() - (steady_ms() - start_ms)) + "\n");
+        if (!file) return false;
+        segment_journal_update(path, true);
+        last_sync_ms = steady_ms();
+        pending_index.clear();
+        dropping = false;
+        dropped_in_run = 0;
+        fps = frame_rate;
+        audio_rate = sample_rate;
+        audio_channels = channels;
+        video_frames = 0;
+        audio_samples = 0;
+        audio_started = false;
+        if (audio_rate > 0 && audio_codec != "pcm" &&
+            !audio_encoder.open(audio_codec, audio_rate, audio_channels, audio_bitrate)) {
+            static bool warned = false;
+            if (!warned) std::cerr << "✗ 音频编码器不可用，改为未压缩 PCM: " << audio_codec << std::endl;
+            warned = true;
+        }
+        last_ts = 0;
+        base_ms = start_ms;
+        video_slot = -1;
+        all_keyframes = codec_id == "V_MJPEG";
+        last_video.clear();
+        cluster.clear();
+        cluster_ts = -1;
+        cluster_cue = false;
+        cues.clear();
+
+        std::vector<uchar> head;
+        std::vector<uchar> ebml;
+        ebml_put_uint(ebml, 0x4286, 1);
+        ebml_put_uint(ebml, 0x42F7, 1);
+        ebml_put_uint(ebml, 0x42F2, 4);
+        ebml_put_uint(ebml, 0x42F3, 8);
+        ebml_put_string(ebml, 0x4282, "matroska");
+        ebml_put_uint(ebml, 0x4287, 4);
+        ebml_put_uint(ebml, 0x4285, 2);
+        ebml_put_master(head, 0x1A45DFA3, ebml);
+
+        // Segment 长度未知，关闭时回填
+        ebml_put_id(head, 0x18538067);
+        segment_size_pos = head.size();
+        head.push_back(0x01);
+        head.insert(head.end(), 7, 0xFF);
+        segment_data_pos = head.size();
+
+        // SeekHead：预留 Cues 位置
+        std::vector<uchar> seek;
+        ebml_put_id(seek, 0x53AB);
+        ebml_put_size(seek, 4);
+        seek.insert(seek.end(), {0x1C, 0x53, 0xBB, 0x6B});
+        ebml_put_id(seek, 0x53AC);
+        ebml_put_size(seek, 8);
+        size_t pos_in_seek = seek.size();
+        seek.insert(seek.end(), 8, 0);
+        std::vector<uchar> seek_entry;
+        ebml_put_master(seek_entry, 0x4DBB, seek);
+        size_t pos_in_entry = seek_entry.size() - seek.size() + pos_in_seek;
+        size_t seek_head_start = head.size();
+        ebml_put_master(head, 0x114D9B74, seek_entry);
+        cues_seek_pos = seek_head_start + (head.size() - seek_head_start - seek_entry.size()) + pos_in_entry;
+
+        // Info：时间单位1毫秒，Duration 关闭时回填
+        std::vector<uchar> info;
+        ebml_put_uint(info, 0x2AD7B1, 1000000);
+        size_t pos_in_info = info.size() + 3;
+        ebml_put_float(info, 0x4489, 0.0);
+        std::vector<uchar> date;
+        ebml_put_id(date, 0x4461);
+        ebml_put_size(date, 8);
+        date.resize(date.size() + 8);
+        put_be64(&date[date.size() - 8], (uint64_t)(std::time(nullptr) - 978307200LL) * 1000000000ULL);
+        info.insert(info.end(), date.begin(), date.end());
+        ebml_put_string(info, 0x4D80, "video_recorder");
+        ebml_put_string(info, 0x5741, "video_recorder");
+        size_t info_start = head.size();
+        ebml_put_master(head, 0x1549A966, info);
+        duration_pos = info_start + (head.size() - info_start - info.size()) + pos_in_info;
+
+        std::vector<uchar> tracks;
+        std::vector<uchar> video_track;
+        ebml_put_uint(video_track, 0xD7, VIDEO_TRACK);
+        ebml_put_uint(video_track, 0x73C5, VIDEO_TRACK);
+        ebml_put_uint(video_track, 0x83, 1);
+        ebml_put_uint(video_track, 0x9C, 0);
+        ebml_put_string(video_track, 0x86, codec_id);
+        if (!codec_private.empty()) {
+            ebml_put_id(video_track, 0x63A2);
+            ebml_put_size(video_track, codec_private.size());
+            video_track.insert(video_track.end(), codec_private.begin(), codec_private.end());
+        }
+        ebml_put_uint(video_track, 0x23E383, 1000000000ULL / fps);
+        std::vector<uchar> video;
+        ebml_put_uint(video, 0xB0, width);
+        ebml_put_uint(video, 0xBA, height);
+        ebml_put_master(video_track, 0xE0, video);
+        ebml_put_master(tracks, 0xAE, video_track);
+
+        if (audio_rate > 0) {
+            std::vector<uchar> audio_track;
+            ebml_put_uint(audio_track, 0xD7, AUDIO_TRACK);
+            ebml_put_uint(audio_track, 0x73C5, AUDIO_TRACK);
+            ebml_put_uint(audio_track, 0x83, 2);
+            ebml_put_uint(audio_track, 0x9C, 0);
+            if (audio_encoder.is_opened()) {
+                ebml_put_string(audio_track, 0x86, audio_encoder.codec_id);
+                if (!audio_encoder.codec_private.empty()) {
+                    ebml_put_id(audio_track, 0x63A2);
+                    ebml_put_size(audio_track, audio_encoder.codec_private.size());
+                    audio_track.insert(audio_track.end(), audio_encoder.codec_private.begin(),
+                                       audio_encoder.codec_private.end());
+                }
+                // 编码器预热样本：播放器解码后丢掉这段
+                if (audio_encoder.padding > 0) {
+                    ebml_put_uint(audio_track, 0x56AA, (uint64_t)audio_encoder.padding * 1000000000ULL / audio_rate);
+                }
+                if (audio_encoder.codec_id == "A_OPUS") ebml_put_uint(audio_track, 0x56BB, 80000000);
+            } else {
+                ebml_put_string(audio_track, 0x86, "A_PCM/INT/LIT");
+            }
+            std::vector<uchar> audio;
+            ebml_put_float(audio, 0xB5, audio_rate);
+            ebml_put_uint(audio, 0x9F, audio_channels);
+            if (!audio_encoder.is_opened() || audio_encoder.codec_id == "A_FLAC") ebml_put_uint(audio, 0x6264, 16);
+            ebml_put_master(audio_track, 0xE1, audio);
+            ebml_put_master(tracks, 0xAE, audio_track);
+        }
+        ebml_put_master(head, 0x1654AE6B, tracks);
+
+        write_pos = head.size();
+        storage_writer.append(file, std::move(head), true);
+        return true;
+    }
+
+    bool is_opened() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return file != nullptr;
+    }
+
+    void flush_cluster() {
+        if (cluster_ts < 0) return;
+        std::vector<uchar> block;
+        block.reserve(cluster.size() + 12);
+        ebml_put_id(block, 0x1F43B675);
+        ebml_put_size(block, cluster.size());
+        block.insert(block.end(), cluster.begin(), cluster.end());
+        size_t block_size = block.size();
+        // 写盘队列积压时整簇丢弃；之后的簇可能引用丢掉的帧，一直丢到视频关键帧开始的簇
+        bool accepted = !(dropping && !cluster_cue) && storage_writer.append(file, std::move(block), false);
+        if (accepted) {
+            if (dropping) {
+                std::cerr << "→ 存储已恢复，共丢弃 " << dropped_in_run << " 个簇：" << path << std::endl;
+                dropping = false;
+                dropped_in_run = 0;
+            }
+            if (cluster_cue) cues.push_back({cluster_ts, write_pos - segment_data_pos});
+            char line[64];
+            snprintf(line, sizeof(line), "%lld\t%lld\t%d\n", (long long)cluster_ts, write_pos, cluster_cue ? 1 : 0);
+            pending_index += line;
+            write_pos += block_size;
+        } else {
+            if (!dropping) std::cerr << "✗ 存储写入跟不上，开始丢弃录像：" << path << std::endl;
+            dropping = true;
+            dropped_in_run++;
+            storage_writer.dropped_clusters++;
+            storage_writer.dropped_bytes += block_size;
+        }
+        cluster.clear();
+        cluster_ts = -1;
+        cluster_cue = false;
+        if (steady_ms() - last_sync_ms >= sync_interval_ms) sync_locked();
+    }
+
+    // 分批落盘交给写盘线程：数据同步后才追加这批簇的索引行
+    void sync_locked() {
+        storage_writer.sync(file, pending_index, false);
+        pending_index.clear();
+        last_sync_ms = steady_ms();
+    }
+
+    void add_block(int track, int64_t ts, bool keyframe, const uchar* data, size_t len) {
+        // 视频关键帧且已满1秒时开新簇；没有关键帧时最多5秒一簇（块内相对时间戳为16位）
+        if (cluster_ts >= 0) {
+            int64_t elapsed = ts - cluster_ts;
+            if ((track == VIDEO_TRACK && keyframe && elapsed >= 1000) || elapsed >= 5000 || elapsed < -30000) {
+                flush_cluster();
+            }
+        }
+        if (cluster_ts < 0) {
+            cluster_ts = ts;
+            cluster_cue = track == VIDEO_TRACK && keyframe;
+            ebml_put_uint(cluster, 0xE7, ts);
+        }
+
+        int16_t rel = (int16_t)(ts - cluster_ts);
+        ebml_put_id(cluster, 0xA3);
+        ebml_put_size(cluster, len + 4);
+        cluster.push_back(0x80 | track);
+        cluster.push_back((uint16_t)rel >> 8);
+        cluster.push_back((uint16_t)rel & 0xFF);
+        cluster.push_back(keyframe ? 0x80 : 0x00);
+        cluster.insert(cluster.end(), data, data + len);
+        last_ts = std::max(last_ts, ts);
+    }
+
+    // capture_ms 为采集时刻（单调时钟）。时间戳按标称帧率划分帧位：与下一帧位相差不到一帧的算作下一帧，
+    // 抖动不影响节奏；早了一帧以上的丢弃，晚了一帧以上的跳到实际帧位并重复上一帧补齐（最多1秒）
+    // H.264 帧互相依赖，只顺延不丢不补
+    void write_video(const std::vector<uchar>& data, bool keyframe, int64_t capture_ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!file) return;
+        int64_t scaled = (capture_ms - base_ms) * fps;       // 单位为 1/fps 毫秒，避免除法误差
+        int64_t slot = std::max<int64_t>(0, (scaled + 500) / 1000);
+        if (video_slot >= 0) {
+            int64_t diff = scaled - (video_slot + 1) * 1000;
+            if (diff <= -1000) slot = video_slot;
+            else if (diff < 1000) slot = video_slot + 1;
+        }
+        if (slot <= video_slot) {
+            if (all_keyframes) {
+                metric_frames_paced_out.add();
+                return;
+            }
+            slot = video_slot + 1;
+        }
+        if (all_keyframes && video_slot >= 0 && slot - video_slot - 1 <= fps) {
+            for (int64_t missing = video_slot + 1; missing < slot; missing++) {
+                add_block(VIDEO_TRACK, missing * 1000 / fps, true, last_video.data(), last_video.size());
+                metric_frames_duplicated.add();
+            }
+        }
+        video_slot = slot;
+        video_frames++;
+        if (all_keyframes) last_video = data;
+        add_block(VIDEO_TRACK, slot * 1000 / fps, keyframe, data.data(), data.size());
+    }
+
+    // capture_ms 为这块第一个样本的采集时刻。声卡时钟与系统时钟有偏差，
+    // 偏差超过40毫秒时补静音或丢样本，使音频始终对齐视频所用的单调时钟
+    void write_audio(const int16_t* samples, size_t frames, int64_t capture_ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!file || audio_rate <= 0) return;
+        int64_t expected = (capture_ms - base_ms) * audio_rate / 1000;
+        int64_t drift = expected - (int64_t)audio_samples;
+        int64_t tolerance = audio_rate * 40 / 1000;
+        size_t skip = 0;
+        if (!audio_started) {
+            // 第一块：开头早于时间戳0的部分丢掉，晚于0（预录）则从对应位置开始
+            audio_started = true;
+            if (expected < 0) skip = std::min<size_t>(frames, -expected);
+            audio_samples = std::max<int64_t>(0, expected);
+        } else if (drift > audio_rate * 5) {
+            // 长时间中断（如设备恢复）不补静音，直接留空
+            audio_samples = expected;
+        } else if (drift > tolerance) {
+            std::vector<int16_t> silence((size_t)std::min<int64_t>(drift, audio_rate / 10) * audio_channels, 0);
+            while (drift > 0) {
+                size_t n = (size_t)std::min<int64_t>(drift, audio_rate / 10);
+                put_audio(silence.data(), n);
+                drift -= n;
+                metric_audio_padded.add(n);
+            }
+        } else if (drift < -tolerance) {
+            skip = std::min<size_t>(frames, -drift);
+            metric_audio_trimmed.add(skip);
+        }
+        if (skip >= frames) return;
+        put_audio(samples + skip * audio_channels, frames - skip);
+    }
+
+    // 在 audio_samples 位置写入一段 PCM：有编码器时按编码器帧分包，否则原样成块
+    void put_audio(const int16_t* samples, size_t frames) {
+        if (audio_encoder.is_opened()) {
+            audio_encoder.encode(samples, frames, audio_samples, audio_packets);
+            write_audio_packets();
+        } else {
+            add_block(AUDIO_TRACK, audio_samples * 1000 / audio_rate, true, (const uchar*)samples,
+                      frames * audio_channels * sizeof(int16_t));
+        }
+        audio_samples += frames;
+    }
+
+    void write_audio_packets() {
+        for (const auto& packet : audio_packets) {
+            add_block(AUDIO_TRACK, std::max<int64_t>(0, packet.pts) * 1000 / audio_rate, true,
+                      packet.data.data(), packet.data.size());
+        }
+        audio_packets.clear();
+    }
+
+    void patch(long long pos, const uchar* data, size_t len) {
+        storage_writer.patch(file, pos, data, len);
+    }
+
+    void close_locked() {
+        if (!file) return;
+        if (audio_encoder.is_opened()) {
+            audio_encoder.flush(audio_packets);
+            write_audio_packets();
+            audio_encoder.close();
+        }
+        flush_cluster();
+
+        // 末尾写入 Cues 索引，便于播放器拖动
+        long long cues_pos = write_pos - segment_data_pos;
+        std::vector<uchar> cue_points;
+        for (const auto& cue : cues) {
+            std::vector<uchar> positions;
+            ebml_put_uint(positions, 0xF7, VIDEO_TRACK);
+            ebml_put_uint(positions, 0xF1, cue.second);
+            std::vector<uchar> point;
+            ebml_put_uint(point, 0xB3, cue.first);
+            ebml_put_master(point, 0xB7, positions);
+            ebml_put_master(cue_points, 0xBB, point);
+        }
+        std::vector<uchar> cues_element;
+        ebml_put_master(cues_element, 0x1C53BB6B, cue_points);
+        write_pos += cues_element.size();
+        storage_writer.append(file, std::move(cues_element), true);
+
+        uchar buf[8];
+        put_be64(buf, cues_pos);
+        patch(cues_seek_pos, buf, 8);
+
+        double duration = last_ts + 1000.0 / fps;
+        uint64_t bits;
+        memcpy(&bits, &duration, sizeof(bits));
+        put_be64(buf, bits);
+        patch(duration_pos, buf, 8);
+
+        std::vector<uchar> size;
+        ebml_put_size8(size, write_pos - segment_data_pos);
+        patch(segment_size_pos, size.data(), size.size());
+
+        // 关闭不等待写盘：写盘线程落盘后关闭文件并从日志中移除
+        storage_writer.sync(file, pending_index, true);
+        pending_index.clear();
+        file.reset();
+        cues.clear();
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex);
+        close_locked();
+    }
+
+    // 写盘线程写当前文件失败后，之后的数据都会被丢弃
+    bool write_failed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return file && file->failed;
+    }
+};
+
+// 编码后的视频包（H.264为长度前缀格式）
+struct VideoPacket {
+    std::vector<uchar> data;
+    bool keyframe;
+    int64_t capture_ms;         // 对应画面的采集时刻（单调时钟），0 表示未知；不加默认值以保持聚合初始化
+};
+
+// 在 Annex-B 字节流中查找下一个起始码，返回起始码位置并通过 sc_len 返回其长度
+size_t find_start_code(const uchar* data, size_t size, size_t from, size_t& sc_len) {
+    for (size_t i = from; i + 3 <= size; i++) {
+        if (data[i] == 0 && data[i + 1] == 0) {
+            if (data[i + 2] == 1) {
+                sc_len = 3;
+                return i;
+            }
+            if (i + 4 <= size && data[i + 2] == 0 && data[i + 3] == 1) {
+                sc_len = 4;
+                return i;
+            }
+        }
+    }
+    sc_len = 0;
+    return size;
+}
+
+// H.264 编码器（libavcodec）：按顺序尝试硬件 V4L2 M2M 与软件编码器
+struct H264Encoder {
+    AVCodecContext* ctx = nullptr;
+    AVFrame* frame = nullptr;
+    AVPacket* pkt = nullptr;
+    std::string name;
+    std::vector<uchar> sps;
+    std::vector<uchar> pps;
+    int64_t next_pts = 0;
+    std::deque<std::pair<int64_t, int64_t>> capture_times;   // (pts, 采集时刻)，编码器可能延迟输出
+    cv::Mat yuv;
+    cv::Mat scaled;
+
+    bool open_codec(const std::string& codec_name, int width, int height, int fps, int bitrate, int gop) {
+        const AVCodec* codec = avcodec_find_encoder_by_name(codec_name.c_str());
+        if (!codec) return false;
+        ctx = avcodec_alloc_context3(codec);
+        if (!ctx) return false;
+        ctx->width = width;
+        ctx->height = height;
+        ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        ctx->time_base = AVRational{1, fps};
+        ctx->framerate = AVRational{fps, 1};
+        ctx->bit_rate = bitrate;
+        ctx->gop_size = gop;
+        ctx->max_b_frames = 0;
+        ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        if (codec_name == "libx264") {
+            av_opt_set(ctx->priv_data, "preset", "veryfast", 0);
+            av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+            av_opt_set(ctx->priv_data, "forced-idr", "1", 0);
+        }
+        if (avcodec_open2(ctx, codec, nullptr) < 0) {
+            avcodec_free_context(&ctx);
+            return false;
+        }
+        if (ctx->extradata_size > 0) {
+            std::vector<uchar> ignored;
+            to_avcc(ctx->extradata, ctx->extradata_size, ignored);
+        }
+
+        frame = av_frame_alloc();
+        frame->format = ctx->pix_fmt;
+        frame->width = width;
+        frame->height = height;
+        if (av_frame_get_buffer(frame, 0) < 0) {
+            close();
+            return false;
+        }
+        pkt = av_packet_alloc();
+        name = codec_name;
+        next_pts = 0;
+        return true;
+    }
+
+    // candidates 依次尝试，全部失败返回false
+    bool open(const std::vector<std::string>& candidates, int width, int height, int fps, int bitrate, int gop) {
+        for (const auto& candidate : candidates) {
+            if (open_codec(candidate, width, height, fps, bitrate, gop)) {
+                std::cout << "✓ H.264编码器: " << candidate << " (" << bitrate / 1000 << " kbps, GOP " << gop << ")" << std::endl;
+                return true;
+            }
+            std::cerr << "✗ 编码器不可用: " << candidate << std::endl;
+        }
+        return false;
+    }
+
+    // Annex-B 转为长度前缀格式；SPS/PPS 保存到 avcC，不写入码流
+    void to_avcc(const uchar* data, size_t size, std::vector<uchar>& out) {
+        // 已经是 avcC（部分编码器的 extradata）
+        if (size > 7 && data[0] == 1) {
+            size_t sps_len = (data[6] << 8) | data[7];
+            if (8 + sps_len + 3 <= size) {
+                sps.assign(data + 8, data + 8 + sps_len);
+                size_t p = 8 + sps_len + 1;
+                size_t pps_len = (data[p] << 8) | data[p + 1];
+                if (p + 2 + pps_len <= size) pps.assign(data + p + 2, data + p + 2 + pps_len);
+            }
+            return;
+        }
+
+        size_t sc_len;
+        size_t pos = find_start_code(data, size, 0, sc_len);
+        while (pos < size) {
+            size_t nal_start = pos + sc_len;
+            size_t next_len;
+            size_t next = find_start_code(data, size, nal_start, next_len);
+            size_t nal_end = next;
+            while (nal_end > nal_start && data[nal_end - 1] == 0) nal_end--;
+            if (nal_end > nal_start) {
+                int type = data[nal_start] & 0x1F;
+                if (type == 7) {
+                    sps.assign(data + nal_start, data + nal_end);
+                } else if (type == 8) {
+                    pps.assign(data + nal_start, data + nal_end);
+                } else if (type != 9) {
+                    uint32_t len = nal_end - nal_start;
+                    out.push_back(len >> 24);
+                    out.push_back(len >> 16);
+                    out.push_back(len >> 8);
+                    out.push_back(len);
+                    out.insert(out.end(), data + nal_start, data + nal_end);
+                }
+            }
+            pos = next;
+            sc_len = next_len;
+        }
+    }
+
+    // AVCDecoderConfigurationRecord，SPS/PPS 未知时为空
+    std::vector<uchar> avcc() const {
+        std::vector<uchar> out;
+        if (sps.size() < 4 || pps.empty()) return out;
+        out = {1, sps[1], sps[2], sps[3], 0xFF, 0xE1};
+        out.push_back(sps.size() >> 8);
+        out.push_back(sps.size() & 0xFF);
+        out.insert(out.end(), sps.begin(), sps.end());
+        out.push_back(1);
+        out.push_back(pps.size() >> 8);
+        out.push_back(pps.size() & 0xFF);
+        out.insert(out.end(), pps.begin(), pps.end());
+        return out;
+    }
+
+    void receive_packets(std::vector<VideoPacket>& out) {
+        while (avcodec_receive_packet(ctx, pkt) == 0) {
+            VideoPacket packet;
+            packet.keyframe = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+            packet.capture_ms = 0;
+            while (!capture_times.empty() && capture_times.front().first < pkt->pts) capture_times.pop_front();
+            if (!capture_times.empty()) packet.capture_ms = capture_times.front().second;
+            to_avcc(pkt->data, pkt->size, packet.data);
+            av_packet_unref(pkt);
+            if (!packet.data.empty()) out.push_back(std::move(packet));
+        }
+    }
+
+    bool encode(const cv::Mat& bgr, bool force_keyframe, int64_t capture_ms, std::vector<VideoPacket>& out) {
+        const cv::Mat* input = &bgr;
+        if (bgr.cols != ctx->width || bgr.rows != ctx->height) {
+            cv::resize(bgr, scaled, cv::Size(ctx->width, ctx->height));
+            input = &scaled;
+        }
+        cv::cvtColor(*input, yuv, cv::COLOR_BGR2YUV_I420);
+        if (av_frame_make_writable(frame) < 0) return false;
+
+        // I420: Y 平面后紧跟 U、V 平面
+        int w = ctx->width;
+        int h = ctx->height;
+        const uchar* src = yuv.data;
+        for (int y = 0; y < h; y++) memcpy(frame->data[0] + y * frame->linesize[0], src + y * w, w);
+        src += w * h;
+        for (int y = 0; y < h / 2; y++) memcpy(frame->data[1] + y * frame->linesize[1], src + y * (w / 2), w / 2);
+        src += (w / 2) * (h / 2);
+        for (int y = 0; y < h / 2; y++) memcpy(frame->data[2] + y * frame->linesize[2], src + y * (w / 2), w / 2);
+
+        frame->pts = next_pts++;
+        capture_times.push_back({frame->pts, capture_ms});
+        if (capture_times.size() > 256) capture_times.pop_front();
+        frame->pict_type = force_keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        if (avcodec_send_frame(ctx, frame) < 0) return false;
+        receive_packets(out);
+        return true;
+    }
+
+    void close() {
+        if (ctx) avcodec_free_context(&ctx);
+        if (frame) av_frame_free(&frame);
+        if (pkt) av_packet_free(&pkt);
+        // 重新打开（可能换成另一个编码器）时不能沿用上一次的参数集和时间戳
+        sps.clear();
+        pps.clear();
+        capture_times.clear();
+    }
+};
+
+// H.264 编码器的尝试顺序：硬件编码优先，指定的编码器排在最前，不可用时退回软件编码
+std::vector<std::string> h264_encoder_candidates(const std::string& codec) {
+    std::vector<std::string> candidates = {"h264_v4l2m2m", "libx264", "libopenh264"};
+    if (codec != "h264") {
+        candidates.erase(std::remove(candidates.begin(), candidates.end(), codec), candidates.end());
+        candidates.insert(candidates.begin(), codec);
+    }
+    return candidates;
+}
+
+// fMP4（ISO BMFF）盒子编码辅助函数
+void mp4_put_u16(std::string& out, uint16_t v) {
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+void mp4_put_u32(std::string& out, uint32_t v) {
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+void mp4_put_u64(std::string& out, uint64_t v) {
+    mp4_put_u32(out, v >> 32);
+    mp4_put_u32(out, v);
+}
+
+// 写入盒子头，返回盒子起始位置，写完内容后用 mp4_box_end 回填大小
+size_t mp4_box_begin(std::string& out, const char* type) {
+    size_t start = out.size();
+    mp4_put_u32(out, 0);
+    out.append(type, 4);
+    return start;
+}
+
+size_t mp4_full_box_begin(std::string& out, const char* type, uint8_t version, uint32_t flags) {
+    size_t start = mp4_box_begin(out, type);
+    mp4_put_u32(out, (version << 24) | flags);
+    return start;
+}
+
+void mp4_box_end(std::string& out, size_t start) {
+    uint32_t size = out.size() - start;
+    out[start] = size >> 24;
+    out[start + 1] = size >> 16;
+    out[start + 2] = size >> 8;
+    out[start + 3] = size;
+}
+
+void mp4_put_matrix(std::string& out) {
+    const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+    for (uint32_t v : matrix) mp4_put_u32(out, v);
+}
+
+const uint32_t HLS_TIMESCALE = 90000;
+
+// 初始化段（ftyp + moov），只含一条 H.264 视频轨
+std::string build_fmp4_init(int width, int height, const std::vector<uchar>& avcc) {
+    std::string out;
+    size_t ftyp = mp4_box_begin(out, "ftyp");
+    out.append("iso6");
+    mp4_put_u32(out, 0);
+    out.append("iso6cmfcmp41");
+    mp4_box_end(out, ftyp);
+
+    size_t moov = mp4_box_begin(out, "moov");
+    size_t mvhd = mp4_full_box_begin(out, "mvhd", 0, 0);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 1000);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 0x00010000);
+    mp4_put_u16(out, 0x0100);
+    out.append(10, '\0');
+    mp4_put_matrix(out);
+    out.append(24, '\0');
+    mp4_put_u32(out, 2);
+    mp4_box_end(out, mvhd);
+
+    size_t trak = mp4_box_begin(out, "trak");
+    size_t tkhd = mp4_full_box_begin(out, "tkhd", 0, 3);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 1);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 0);
+    out.append(8, '\0');
+    mp4_put_u16(out, 0);
+    mp4_put_u16(out, 0);
+    mp4_put_u16(out, 0);
+    mp4_put_u16(out, 0);
+    mp4_put_matrix(out);
+    mp4_put_u32(out, width << 16);
+    mp4_put_u32(out, height << 16);
+    mp4_box_end(out, tkhd);
+
+    size_t mdia = mp4_box_begin(out, "mdia");
+    size_t mdhd = mp4_full_box_begin(out, "mdhd", 0, 0);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, HLS_TIMESCALE);
+    mp4_put_u32(out, 0);
+    mp4_put_u16(out, 0x55C4);  // und
+    mp4_put_u16(out, 0);
+    mp4_box_end(out, mdhd);
+
+    size_t hdlr = mp4_full_box_begin(out, "hdlr", 0, 0);
+    mp4_put_u32(out, 0);
+    out.append("vide");
+    out.append(12, '\0');
+    out.append("VideoHandler", 13);
+    mp4_box_end(out, hdlr);
+
+    size_t minf = mp4_box_begin(out, "minf");
+    size_t vmhd = mp4_full_box_begin(out, "vmhd", 0, 1);
+    out.append(8, '\0');
+    mp4_box_end(out, vmhd);
+
+    size_t dinf = mp4_box_begin(out, "dinf");
+    size_t dref = mp4_full_box_begin(out, "dref", 0, 0);
+    mp4_put_u32(out, 1);
+    size_t url = mp4_full_box_begin(out, "url ", 0, 1);
+    mp4_box_end(out, url);
+    mp4_box_end(out, dref);
+    mp4_box_end(out, dinf);
+
+    size_t stbl = mp4_box_begin(out, "stbl");
+    size_t stsd = mp4_full_box_begin(out, "stsd", 0, 0);
+    mp4_put_u32(out, 1);
+    size_t avc1 = mp4_box_begin(out, "avc1");
+    out.append(6, '\0');
+    mp4_put_u16(out, 1);
+    out.append(16, '\0');
+    mp4_put_u16(out, width);
+    mp4_put_u16(out, height);
+    mp4_put_u32(out, 0x00480000);
+    mp4_put_u32(out, 0x00480000);
+    mp4_put_u32(out, 0);
+    mp4_put_u16(out, 1);
+    out.append(32, '\0');
+    mp4_put_u16(out, 0x0018);
+    mp4_put_u16(out, 0xFFFF);
+    size_t avcc_box = mp4_box_begin(out, "avcC");
+    out.append((const char*)avcc.data(), avcc.size());
+    mp4_box_end(out, avcc_box);
+    mp4_box_end(out, avc1);
+    mp4_box_end(out, stsd);
+    for (const char* type : {"stts", "stsc", "stco"}) {
+        size_t box = mp4_full_box_begin(out, type, 0, 0);
+        mp4_put_u32(out, 0);
+        mp4_box_end(out, box);
+    }
+    size_t stsz = mp4_full_box_begin(out, "stsz", 0, 0);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 0);
+    mp4_box_end(out, stsz);
+    mp4_box_end(out, stbl);
+    mp4_box_end(out, minf);
+    mp4_box_end(out, mdia);
+    mp4_box_end(out, trak);
+
+    size_t mvex = mp4_box_begin(out, "mvex");
+    size_t trex = mp4_full_box_begin(out, "trex", 0, 0);
+    mp4_put_u32(out, 1);
+    mp4_put_u32(out, 1);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 0);
+    mp4_put_u32(out, 0);
+    mp4_box_end(out, trex);
+    mp4_box_end(out, mvex);
+    mp4_box_end(out, moov);
+    return out;
+}
+
+// 媒体分片（moof + mdat），每个样本时长相同
+std::string build_fmp4_fragment(uint32_t sequence, uint64_t decode_time, uint32_t sample_duration,
+                                const std::vector<VideoPacket>& samples) {
+    std::string out;
+    size_t moof = mp4_box_begin(out, "moof");
+    size_t mfhd = mp4_full_box_begin(out, "mfhd", 0, 0);
+    mp4_put_u32(out, sequence);
+    mp4_box_end(out, mfhd);
+
+    size_t traf = mp4_box_begin(out, "traf");
+    size_t tfhd = mp4_full_box_begin(out, "tfhd", 0, 0x020000);  // default-base-is-moof
+    mp4_put_u32(out, 1);
+    mp4_box_end(out, tfhd);
+    size_t tfdt = mp4_full_box_begin(out, "tfdt", 1, 0);
+    mp4_put_u64(out, decode_time);
+    mp4_box_end(out, tfdt);
+
+    // data-offset | sample-duration | sample-size | sample-flags
+    size_t trun = mp4_full_box_begin(out, "trun", 0, 0x000701);
+    mp4_put_u32(out, samples.size());
+    size_t data_offset_pos = out.size();
+    mp4_put_u32(out, 0);
+    size_t mdat_size = 8;
+    for (const auto& sample : samples) {
+        mp4_put_u32(out, sample_duration);
+        mp4_put_u32(out, sample.data.size());
+        mp4_put_u32(out, sample.keyframe ? 0x02000000 : 0x01010000);
+        mdat_size += sample.data.size();
+    }
+    mp4_box_end(out, trun);
+    mp4_box_end(out, traf);
+    mp4_box_end(out, moof);
+
+    uint32_t data_offset = out.size() + 8;
+    for (int i = 0; i < 4; i++) out[data_offset_pos + i] = data_offset >> (24 - 8 * i);
+
+    out.reserve(out.size() + mdat_size);
+    mp4_put_u32(out, mdat_size);
+    out.append("mdat");
+    for (const auto& sample : samples) out.append((const char*)sample.data.data(), sample.data.size());
+    return out;
+}
+
+// 低延迟HLS分段器：与录像共用同一路H.264编码输出，在内存中保留最近几个 fMP4 分段及其部分分段
+struct HlsPart {
+    std::shared_ptr<const std::string> data;
+    double duration;
+    bool independent;
+};
+
+struct HlsSegment {
+    int64_t msn;
+    double duration = 0;
+    bool complete = false;
+    std::vector<HlsPart> parts;
+};
+
+struct HlsSegmenter {
+    std::mutex mutex;
+    std::atomic<bool> enabled{false};   // HTTP线程不加锁读取
+    int fps = 20;
+    double target_duration = 2.0;
+    double part_target = 0.5;
+    size_t window = 6;
+    std::shared_ptr<const std::string> init_segment;
+    std::deque<HlsSegment> segments;
+    int64_t next_msn = 0;
+    uint32_t fragment_seq = 1;
+    uint64_t decode_time = 0;
+    std::vector<VideoPacket> pending;   // 当前部分分段尚未输出的样本
+    std::atomic<int> notify_fd{-1};     // Web服务器的eventfd，有新的部分分段时唤醒阻塞的播放列表请求
+
+    void start(int width, int height, int frame_rate, const std::vector<uchar>& avcc) {
+        std::lock_guard<std::mutex> lock(mutex);
+        fps = frame_rate;
+        init_segment = std::make_shared<std::string>(build_fmp4_init(width, height, avcc));
+        enabled = true;
+    }
+
+    uint32_t sample_duration() const {
+        return HLS_TIMESCALE / fps;
+    }
+
+    void flush_part_locked() {
+        if (pending.empty() || segments.empty()) return;
+        HlsPart part;
+        part.duration = (double)pending.size() / fps;
+        part.independent = pending.front().keyframe;
+        part.data = std::make_shared<std::string>(
+            build_fmp4_fragment(fragment_seq++, decode_time, sample_duration(), pending));
+        decode_time += (uint64_t)sample_duration() * pending.size();
+        segments.back().parts.push_back(part);
+        segments.back().duration += part.duration;
+        pending.clear();
+    }
+
+    void add(const VideoPacket& packet) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!enabled) return;
+
+            double current = segments.empty() || segments.back().complete ? 0 :
+                             segments.back().duration + (double)pending.size() / fps;
+            // 分段只在关键帧处切换
+            if (packet.keyframe && current >= target_duration) {
+                flush_part_locked();
+                segments.back().complete = true;
+            }
+            if (segments.empty() || segments.back().complete) {
+                if (!packet.keyframe) return;
+                HlsSegment segment;
+                segment.msn = next_msn++;
+                segments.push_back(segment);
+                while (segments.size() > window) segments.pop_front();
+            }
+
+            pending.push_back(packet);
+            // 再加一帧就超过 PART-TARGET 时输出；帧率不能整除时（如25fps）部分分段略短于目标而不能更长
+            if ((double)(pending.size() + 1) / fps <= part_target + 1e-6) return;
+            flush_part_locked();
+        }
+
+        int fd = notify_fd;
+        if (fd >= 0) {
+            uint64_t one = 1;
+            ssize_t ret = write(fd, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+
+    // 阻塞式播放列表重载：指定的分段/部分分段是否已经可用
+    bool ready(int64_t msn, int64_t part) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (segments.empty()) return false;
+        const HlsSegment& last = segments.back();
+        if (last.msn > msn) return true;
+        if (last.msn < msn) return false;
+        if (part < 0) return last.complete;
+        return last.complete || (int64_t)last.parts.size() > part;
+    }
+
+    std::string playlist() {
+        std::lock_guard<std::mutex> lock(mutex);
+        double max_duration = target_duration;
+        for (const auto& segment : segments) max_duration = std::max(max_duration, segment.duration);
+
+        std::ostringstream m3u8;
+        m3u8 << std::fixed;
+        m3u8.precision(3);
+        m3u8 << "#EXTM3U\n";
+        m3u8 << "#EXT-X-VERSION:9\n";
+        m3u8 << "#EXT-X-TARGETDURATION:" << (int)std::ceil(max_duration) << "\n";
+        m3u8 << "#EXT-X-PART-INF:PART-TARGET=" << part_target << "\n";
+        m3u8 << "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=" << part_target * 3 << "\n";
+        m3u8 << "#EXT-X-MEDIA-SEQUENCE:" << (segments.empty() ? 0 : segments.front().msn) << "\n";
+        m3u8 << "#EXT-X-MAP:URI=\"init.mp4\"\n";
+
+        // 只为最后几个分段列出部分分段
+        size_t part_from = segments.size() > 3 ? segments.size() - 3 : 0;
+        for (size_t i = 0; i < segments.size(); i++) {
+            const HlsSegment& segment = segments[i];
+            if (i >= part_from) {
+                for (size_t p = 0; p < segment.parts.size(); p++) {
+                    m3u8 << "#EXT-X-PART:DURATION=" << segment.parts[p].duration
+                         << ",URI=\"part" << segment.msn << "." << p << ".m4s\""
+                         << (segment.parts[p].independent ? ",INDEPENDENT=YES" : "") << "\n";
+                }
+            }
+            if (segment.complete) {
+                m3u8 << "#EXTINF:" << segment.duration << ",\n";
+                m3u8 << "seg" << segment.msn << ".m4s\n";
+            }
+        }
+        return m3u8.str();
+    }
+
+    // 完整分段由各部分分段依次拼接而成，返回各部分的共享缓冲区，无需拷贝
+    bool get_segment(int64_t msn, std::vector<std::shared_ptr<const std::string>>& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& segment : segments) {
+            if (segment.msn != msn) continue;
+            if (!segment.complete) return false;
+            for (const auto& part : segment.parts) out.push_back(part.data);
+            return true;
+        }
+        return false;
+    }
+
+    std::shared_ptr<const std::string> get_part(int64_t msn, size_t index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& segment : segments) {
+            if (segment.msn == msn && index < segment.parts.size()) return segment.parts[index].data;
+        }
+        return nullptr;
+    }
+};
+
+// 时间戳叠加：字符只在启动时用 putText 光栅化一次存入字模表，
+// 每秒重新拼一次标签，逐帧只做一次按 alpha 的混合
+struct TimestampOverlay {
+    static constexpr const char* CHARSET = "0123456789-: ";
+    double scale = 0.7;
+    int thickness = 2;
+    int cell_width = 0;
+    int cell_height = 0;
+    int baseline = 0;
+    cv::Mat atlas;           // 单通道，每个字符占一个 cell，值即 alpha
+    cv::Mat label;           // 当前秒的标签 alpha
+    time_t label_second = -1;
+
+    void build_atlas() {
+        for (const char* c = CHARSET; *c; c++) {
+            int base = 0;
+            cv::Size size = cv::getTextSize(std::string(1, *c), cv::FONT_HERSHEY_SIMPLEX, scale, thickness, &base);
+            cell_width = std::max(cell_width, size.width);
+            cell_height = std::max(cell_height, size.height + base + thickness);
+            baseline = std::max(baseline, base);
+        }
+        int count = strlen(CHARSET);
+        atlas = cv::Mat(cell_height, cell_width * count, CV_8UC1, cv::Scalar(0));
+        for (int i = 0; i < count; i++) {
+            cv::putText(atlas, std::string(1, CHARSET[i]), cv::Point(i * cell_width, cell_height - baseline - 1),
+                        cv::FONT_HERSHEY_SIMPLEX, scale, cv::Scalar(255), thickness);
+        }
+    }
+
+    void compose(time_t now) {
+        char text[32];
+        std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
+        int len = strlen(text);
+        label = cv::Mat(cell_height, cell_width * len, CV_8UC1, cv::Scalar(0));
+        for (int i = 0; i < len; i++) {
+            const char* pos = strchr(CHARSET, text[i]);
+            int index = pos ? pos - CHARSET : strlen(CHARSET) - 1;
+            atlas(cv::Rect(index * cell_width, 0, cell_width, cell_height))
+                .copyTo(label(cv::Rect(i * cell_width, 0, cell_width, cell_height)));
+        }
+        label_second = now;
+    }
+
+    // 在帧左下角叠加白色时间戳（BGR 8位图像）
+    void apply(cv::Mat& frame) {
+        if (atlas.empty()) build_atlas();
+        time_t now = time(nullptr);
+        if (now != label_second) compose(now);
+
+        int x0 = 10;
+        int y0 = frame.rows - 10 - (cell_height - baseline - 1);
+        int w = std::min(label.cols, frame.cols - x0);
+        int h = std::min(label.rows, frame.rows - y0);
+        if (x0 < 0 || y0 < 0 || w <= 0 || h <= 0) return;
+
+        for (int y = 0; y < h; y++) {
+            const uchar* alpha = label.ptr<uchar>(y);
+            uchar* dst = frame.ptr<uchar>(y0 + y) + x0 * 3;
+            for (int x = 0; x < w; x++, dst += 3) {
+                int a = alpha[x];
+                if (a == 0) continue;
+                dst[0] += ((255 - dst[0]) * a + 127) / 255;
+                dst[1] += ((255 - dst[1]) * a + 127) / 255;
+                dst[2] += ((255 - dst[2]) * a + 127) / 255;
+            }
+        }
+    }
+};
+
+// 音频采集参数（与原 arecord -f cd 一致；opus 只支持 48 kHz，选 opus 时按 48 kHz 采集）
+std::string audio_device = "plughw:CARD=Device,DEV=0";
+int audio_sample_rate = 44100;
+const int audio_channels = 2;
+int audio_period_frames = 4410;  // 每块100毫秒
+
+// 音频来源：ALSA 设备；测试时可用 sine[:频率] 正弦波或 wav=路径 循环回放，按实时节奏产生样本
+struct AudioSource {
+    snd_pcm_t* pcm = nullptr;
+    double sine_hz = 0;
+    std::vector<int16_t> wav;           // 交错样本，声道数与 audio_channels 一致
+    size_t wav_pos = 0;
+    uint64_t produced = 0;              // 合成来源已产生的样本数
+    int64_t start_ms = 0;
+
+    // 读取16位 PCM WAV，单声道复制为双声道；采样率不同时只提示，不重采样
+    bool load_wav(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        char riff[12];
+        if (!in.read(riff, 12) || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) return false;
+        int channels = 0;
+        int rate = 0;
+        int bits = 0;
+        char chunk[8];
+        while (in.read(chunk, 8)) {
+            uint32_t size = (uchar)chunk[4] | (uchar)chunk[5] << 8 | (uchar)chunk[6] << 16 | (uint32_t)(uchar)chunk[7] << 24;
+            if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+                std::vector<char> fmt(size);
+                in.read(fmt.data(), size);
+                channels = (uchar)fmt[2] | (uchar)fmt[3] << 8;
+                rate = (uchar)fmt[4] | (uchar)fmt[5] << 8 | (uchar)fmt[6] << 16 | (uchar)fmt[7] << 24;
+                bits = (uchar)fmt[14] | (uchar)fmt[15] << 8;
+            } else if (memcmp(chunk, "data", 4) == 0) {
+                if (bits != 16 || channels < 1 || channels > 2) return false;
+                std::vector<int16_t> samples(size / 2);
+                in.read((char*)samples.data(), samples.size() * 2);
+                samples.resize(in.gcount() / 2);
+                wav.clear();
+                for (size_t i = 0; i + channels <= samples.size(); i += channels) {
+                    wav.push_back(samples[i]);
+                    wav.push_back(samples[i + channels - 1]);
+                }
+                if (rate != audio_sample_rate) {
+                    std::cerr << "→ WAV 采样率 " << rate << " Hz 与采集设置 " << audio_sample_rate << " Hz 不同，未重采样" << std::endl;
+                }
+                return !wav.empty();
+            } else {
+                in.seekg(size + (size & 1), std::ios::cur);
+            }
+        }
+        return false;
+    }
+
+    bool open(const std::string& device) {
+        produced = 0;
+        start_ms = steady_ms();
+        if (device.compare(0, 4, "sine") == 0) {
+            sine_hz = device.size() > 5 ? std::atof(device.c_str() + 5) : 1000;
+            return sine_hz > 0;
+        }
+        if (device.compare(0, 4, "wav=") == 0) return load_wav(device.substr(4));
+        if (snd_pcm_open(&pcm, device.c_str(), SND_PCM_STREAM_CAPTURE, 0) < 0) return false;
+        if (snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                               audio_channels, audio_sample_rate, 1, 500000) < 0) {
+            snd_pcm_close(pcm);
+            pcm = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    // 读一块，capture_ms 为第一个样本的采集时刻
+    // 声卡：读到的时刻 - 缓冲中尚未读出的样本 - 本块长度，与视频共用单调时钟
+    long read(int16_t* buf, size_t frames, int64_t& capture_ms) {
+        if (pcm) {
+            snd_pcm_sframes_t n = snd_pcm_readi(pcm, buf, frames);
+            if (n < 0) {
+                if (snd_pcm_recover(pcm, n, 1) < 0) usleep(100000);
+                return n;
+            }
+            int64_t now_ms = steady_ms();
+            snd_pcm_sframes_t delay = 0;
+            if (snd_pcm_delay(pcm, &delay) < 0 || delay < 0) delay = 0;
+            capture_ms = now_ms - (int64_t)(n + delay) * 1000 / audio_sample_rate;
+            return n;
+        }
+        capture_ms = start_ms + (int64_t)(produced * 1000 / audio_sample_rate);
+        int64_t wait_ms = start_ms + (int64_t)((produced + frames) * 1000 / audio_sample_rate) - steady_ms();
+        if (wait_ms > 0) usleep(wait_ms * 1000);
+        for (size_t i = 0; i < frames; i++) {
+            int16_t left, right;
+            if (!wav.empty()) {
+                left = wav[wav_pos];
+                right = wav[wav_pos + 1];
+                wav_pos = (wav_pos + 2) % wav.size();
+            } else {
+                // -12 dBFS 正弦波
+                left = right = (int16_t)(8192 * std::sin(2 * M_PI * sine_hz * (double)(produced + i) / audio_sample_rate));
+            }
+            buf[i * audio_channels] = left;
+            buf[i * audio_channels + 1] = right;
+        }
+        produced += frames;
+        return frames;
+    }
+
+    void close() {
+        if (pcm) snd_pcm_close(pcm);
+        pcm = nullptr;
+    }
+};
+
+// 采集线程到处理线程的单生产者单消费者环形队列，每槽一块（100毫秒）
+// 采集线程只读声卡和入队，不加锁也不等待；队列满时丢弃新块并计数，避免声卡缓冲溢出
+struct AudioRing {
+    static const size_t SLOTS = 64;     // 约6秒，足够吸收写盘或编码的短暂停顿
+
+    struct Block {
+        int64_t capture_ms = 0;         // 第一个样本的采集时刻（单调时钟）
+        size_t frames = 0;
+        std::vector<int16_t> samples;
+    };
+
+    Block blocks[SLOTS];
+    std::atomic<uint64_t> head{0};      // 已写入的块数（生产者）
+    std::atomic<uint64_t> tail{0};      // 已取走的块数（消费者）
+    std::atomic<uint32_t> futex_word{0};
+    std::atomic<uint64_t> overruns{0};
+
+    void init(size_t frames, int channels) {
+        for (auto& block : blocks) block.samples.resize(frames * channels);
+    }
+
+    // 生产者：取得下一个空槽，满时返回 nullptr
+    Block* write_slot() {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= SLOTS) return nullptr;
+        return &blocks[h % SLOTS];
+    }
+
+    void commit() {
+        head.fetch_add(1, std::memory_order_release);
+        futex_word++;
+        futex_call(&futex_word, FUTEX_WAKE_PRIVATE, 1, nullptr);
+    }
+
+    // 消费者：等待下一块，最多等 timeout_ms；虚假唤醒或信号中断后按剩余时间继续等，超时返回 nullptr
+    Block* read_slot(int timeout_ms) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        int64_t deadline = steady_ms() + timeout_ms;
+        while (head.load(std::memory_order_acquire) == t) {
+            uint32_t word = futex_word;
+            if (head.load(std::memory_order_acquire) != t) break;
+            int64_t remaining = deadline - steady_ms();
+            if (remaining <= 0) return nullptr;
+            struct timespec ts = {(time_t)(remaining / 1000), (long)(remaining % 1000) * 1000000L};
+            futex_call(&futex_word, FUTEX_WAIT_PRIVATE, word, &ts);
+        }
+        return &blocks[t % SLOTS];
+    }
+
+    void release() {
+        tail.fetch_add(1, std::memory_order_release);
+    }
+
+    size_t backlog() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+};
+
+AudioRing audio_ring;
+
+// 音量表：每块的 RMS 与峰值（dBFS，百分之一分贝存为整数以便原子读写），供网页和 /metrics 显示
+// 设置响度阈值后，RMS 超过阈值视为声音事件，与运动一样触发事件录制
+struct AudioMeter {
+    static const int FLOOR_CDB = -9600;   // 16位 PCM 的动态范围下限
+
+    std::atomic<int> rms_cdb{FLOOR_CDB};
+    std::atomic<int> peak_cdb{FLOOR_CDB};
+    std::atomic<uint64_t> clipped{0};        // 削顶样本数
+    std::atomic<int64_t> last_loud_ms{0};
+    bool enabled = false;                    // 声卡已打开
+    bool loudness_trigger = false;
+    double loudness_threshold_db = -20;
+
+    static int to_cdb(double level) {
+        if (level <= 0) return FLOOR_CDB;
+        // 不用 std::max：按引用传入静态常量成员需要类外定义，-O0 下会链接失败
+        int cdb = (int)std::lround(2000.0 * std::log10(level / 32768.0));
+        return cdb > FLOOR_CDB ? cdb : FLOOR_CDB;
+    }
+
+    void measure(const int16_t* samples, size_t count) {
+        double sum = 0;
+        int peak = 0;
+        uint64_t clips = 0;
+        for (size_t i = 0; i < count; i++) {
+            int v = std::abs((int)samples[i]);
+            sum += (double)v * v;
+            peak = std::max(peak, v);
+            if (v >= 32767) clips++;
+        }
+        int rms = to_cdb(count > 0 ? std::sqrt(sum / count) : 0);
+        rms_cdb = rms;
+        peak_cdb = to_cdb(peak);
+        if (clips > 0) clipped += clips;
+        if (loudness_trigger && rms >= loudness_threshold_db * 100) last_loud_ms = steady_ms();
+    }
+
+    // 最近 hold_ms 内超过响度阈值
+    bool loud(int64_t hold_ms) const {
+        int64_t last = last_loud_ms;
+        return loudness_trigger && last > 0 && steady_ms() - last < hold_ms;
+    }
+};
+
+AudioMeter audio_meter;
+
+// 进程内音频采集线程：只读音频来源入队，编码与写文件在处理线程
+void audio_capture_thread(AudioSource* source) {
+    set_thread_name("audio-cap");
+    std::vector<int16_t> scratch(audio_period_frames * audio_channels);
+    while (running) {
+        AudioRing::Block* block = audio_ring.write_slot();
+        int16_t* buf = block ? block->samples.data() : scratch.data();
+        int64_t capture_ms = 0;
+        long n = source->read(buf, audio_period_frames, capture_ms);
+        if (n < 0) continue;
+        if (!block) {
+            audio_ring.overruns++;
+            continue;
+        }
+        block->frames = n;
+        block->capture_ms = capture_ms;
+        audio_ring.commit();
+    }
+}
+
+// 音频处理线程：计算音量，压缩后写入各路选定摄像头的当前录像文件（每路各自编码）
+void audio_process_thread(std::vector<MkvWriter*> writers) {
+    set_thread_name("audio-enc");
+    while (running) {
+        AudioRing::Block* block = audio_ring.read_slot(200);
+        if (!block) continue;
+        uint64_t step_ns = metric_now_ns();
+        audio_meter.measure(block->samples.data(), block->frames * audio_channels);
+        for (MkvWriter* writer : writers) writer->write_audio(block->samples.data(), block->frames, block->capture_ms);
+        metric_audio_encode.observe_since(step_ns);
+        audio_ring.release();
+    }
+}
+
+// 文件信息结构体
+struct FileInfo {
+    std::string name;
+    std::string path;
+    long long size;
+    time_t mtime;
+    
+    bool operator<(const FileInfo& other) const {
+        return mtime > other.mtime;
+    }
+};
+
+long long get_free_disk_space(const std::string& path) {
+    struct statvfs buf;
+    if (statvfs(path.c_str(), &buf) != 0) return -1;
+    return (long long)buf.f_frsize * (long long)buf.f_bavail;
+}
+
+long long get_total_disk_space(const std::string& path) {
+    struct statvfs buf;
+    if (statvfs(path.c_str(), &buf) != 0) return -1;
+    return (long long)buf.f_frsize * (long long)buf.f_blocks;
+}
+
+bool is_recording_file(const std::string& filename) {
+    if (filename.length() <= 4 || filename[0] == '.') return false;
+    std::string ext = filename.substr(filename.length() - 4);
+    return ext == ".avi" || ext == ".wav" || ext == ".mp4" || ext == ".mkv";
+}
+
+// 录像所属的摄像头：第一路的文件名以时间开头（返回空），其余各路以 "<名称>_" 开头
+std::string recording_camera(const std::string& filename) {
+    if (filename.empty() || !isalpha((unsigned char)filename[0])) return "";
+    size_t underscore = filename.find('_');
+    return underscore == std::string::npos ? "" : filename.substr(0, underscore);
+}
+
+std::vector<FileInfo> get_video_files(const std::string& dir) {
+    std::vector<FileInfo> files;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return files;
+
+    struct dirent* entry;
+    while ((entry = readdir(d)) != nullptr) {
+        if (entry->d_type == DT_REG) {
+            std::string filename = entry->d_name;
+            if (is_recording_file(filename)) {
+                std::string file_path = dir + "/" + filename;
+                struct stat file_stat;
+                if (stat(file_path.c_str(), &file_stat) == 0) {
+                    FileInfo info;
+                    info.name = filename;
+                    info.path = file_path;
+                    info.size = file_stat.st_size;
+                    info.mtime = file_stat.st_mtime;
+                    files.push_back(info);
+                }
+            }
+        }
+    }
+    closedir(d);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// 命令行参数，格式为 --key=value
+std::map<std::string, std::string> parse_options(int argc, char* argv[]) {
+    std::map<std::string, std::string> options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) continue;
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            options[arg.substr(2)] = "1";
+        } else {
+            options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+        }
+    }
+    return options;
+}
+
+// 逐级创建目录（mkdir -p）
+bool make_dirs(const std::string& path) {
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        std::string dir = path.substr(0, pos);
+        if (!dir.empty() && mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        if (pos == std::string::npos) return true;
+    }
+}
+
+std::string get_option(const std::map<std::string, std::string>& options, const std::string& key, const std::string& default_value) {
+    auto it = options.find(key);
+    return it == options.end() ? default_value : it->second;
+}
+
+std::string format_size(long long bytes) {
+    if (bytes < 1024) return std::to_string(bytes) + " B";
+    if (bytes < 1024 * 1024) return std::to_string(bytes / 1024) + " KB";
+    if (bytes < 1024 * 1024 * 1024) return std::to_string(bytes / 1024 / 1024) + " MB";
+    return std::to_string(bytes / 1024 / 1024 / 1024) + " GB";
+}
+
+std::string format_time(time_t t) {
+    char buf[64];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", std::localtime(&t));
+    return std::string(buf);
+}
+
+// 录像文件索引：内存中按修改时间升序保存，由 inotify 保持同步，避免每次请求都扫描目录
+// 新录像追加在末尾、清理从头部删除，都是O(1)；分页和时间范围查询靠下标和二分查找
+struct RecordingCatalog {
+    std::mutex mutex;
+    std::string dir;
+    std::deque<FileInfo> files;                        // 按 (mtime, name) 升序
+    std::unordered_map<std::string, time_t> mtime_of;  // 文件名 -> mtime，用于定位
+    bool dirty = false;
+    int inotify_fd = -1;
+
+    static bool older(const FileInfo& a, const FileInfo& b) {
+        return a.mtime != b.mtime ? a.mtime < b.mtime : a.name < b.name;
+    }
+
+    std::string index_path() const {
+        return dir + "/.catalog";
+    }
+
+    std::deque<FileInfo>::iterator find_locked(const std::string& name) {
+        auto it = mtime_of.find(name);
+        if (it == mtime_of.end()) return files.end();
+        FileInfo key;
+        key.name = name;
+        key.mtime = it->second;
+        auto pos = std::lower_bound(files.begin(), files.end(), key, older);
+        if (pos != files.end() && pos->name == name) return pos;
+        return files.end();
+    }
+
+    void erase_locked(const std::string& name) {
+        auto pos = find_locked(name);
+        if (pos == files.end()) return;
+        if (pos == files.begin()) {
+            files.pop_front();
+        } else {
+            files.erase(pos);
+        }
+        mtime_of.erase(name);
+        dirty = true;
+    }
+
+    void insert_locked(const FileInfo& info) {
+        erase_locked(info.name);
+        if (files.empty() || !older(info, files.back())) {
+            files.push_back(info);
+        } else {
+            files.insert(std::upper_bound(files.begin(), files.end(), info, older), info);
+        }
+        mtime_of[info.name] = info.mtime;
+        dirty = true;
+    }
+
+    // 重新stat单个文件并更新索引，文件不存在则移除
+    void refresh(const std::string& name) {
+        if (!is_recording_file(name)) return;
+        std::string path = dir + "/" + name;
+        struct stat file_stat;
+        bool exists = stat(path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!exists) {
+            erase_locked(name);
+            return;
+        }
+        FileInfo info;
+        info.name = name;
+        info.path = path;
+        info.size = file_stat.st_size;
+        info.mtime = file_stat.st_mtime;
+        insert_locked(info);
+    }
+
+    void remove(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        erase_locked(name);
+    }
+
+    // 完整重建（inotify 事件溢出时使用）
+    void rescan() {
+        std::vector<FileInfo> scanned = get_video_files(dir);
+        std::lock_guard<std::mutex> lock(mutex);
+        files.assign(scanned.begin(), scanned.end());
+        std::sort(files.begin(), files.end(), older);
+        mtime_of.clear();
+        for (const auto& info : files) mtime_of[info.name] = info.mtime;
+        dirty = true;
+    }
+
+    // 先建立目录监听，再加载索引，两者之间发生的变化不会丢失
+    void start_watch(const std::string& video_dir) {
+        dir = video_dir;
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, dir.c_str(),
+                IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
+        if (inotify_fd < 0) {
+            std::cerr << "✗ 无法监听录像目录，列表只在启动时建立" << std::endl;
+        }
+    }
+
+    // 启动时读取持久化索引，只对新出现的文件和最近几个文件做stat
+    void load() {
+        std::unordered_map<std::string, FileInfo> saved;
+        std::ifstream in(index_path());
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            FileInfo info;
+            if (std::getline(fields, info.name, '\t') && fields >> info.size >> info.mtime) {
+                info.path = dir + "/" + info.name;
+                saved[info.name] = info;
+            }
+        }
+
+        std::vector<std::string> unknown;
+        std::vector<FileInfo> known;
+        DIR* d = opendir(dir.c_str());
+        if (d) {
+            struct dirent* entry;
+            while ((entry = readdir(d)) != nullptr) {
+                if (entry->d_type != DT_REG) continue;
+                std::string filename = entry->d_name;
+                if (!is_recording_file(filename)) continue;
+                auto it = saved.find(filename);
+                if (it != saved.end()) {
+                    known.push_back(it->second);
+                } else {
+                    unknown.push_back(filename);
+                }
+            }
+            closedir(d);
+        }
+
+        // 新文件先全部stat，与缓存条目一起排序一次；逐个插入有序队列在上万个文件时是平方级的
+        size_t cached = known.size();
+        for (const auto& name : unknown) {
+            FileInfo info;
+            info.name = name;
+            info.path = dir + "/" + name;
+            struct stat file_stat;
+            if (stat(info.path.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) continue;
+            info.size = file_stat.st_size;
+            info.mtime = file_stat.st_mtime;
+            known.push_back(info);
+        }
+
+        std::vector<std::string> recent;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            files.assign(known.begin(), known.end());
+            std::sort(files.begin(), files.end(), older);
+            mtime_of.clear();
+            for (const auto& info : files) mtime_of[info.name] = info.mtime;
+            if (!unknown.empty()) dirty = true;
+            // 上次退出时可能仍在写入的最新文件需要重新stat
+            for (size_t i = 0; i < files.size() && i < 3; i++) recent.push_back(files[files.size() - 1 - i].name);
+        }
+        for (const auto& name : recent) refresh(name);
+
+        std::cout << "✓ 录像索引: " << cached << " 个来自缓存, "
+                  << unknown.size() << " 个新文件" << std::endl;
+    }
+
+    void save() {
+        std::vector<FileInfo> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!dirty) return;
+            snapshot.assign(files.begin(), files.end());
+            dirty = false;
+        }
+        std::string tmp_path = index_path() + ".tmp";
+        std::ofstream out(tmp_path, std::ios::trunc);
+        for (const auto& info : snapshot) {
+            out << info.name << '\t' << info.size << '\t' << info.mtime << '\n';
+        }
+        out.close();
+        if (out) rename(tmp_path.c_str(), index_path().c_str());
+    }
+
+    bool oldest(FileInfo& info) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (files.empty()) return false;
+        info = files.front();
+        return true;
+    }
+
+    size_t count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return files.size();
+    }
+
+    // 按时间范围 [from, to] 从新到旧分页查询，from/to 为0表示不限；total 返回范围内文件总数
+    std::vector<FileInfo> list(size_t offset, size_t limit, time_t from, time_t to, size_t* total = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto lo = files.begin();
+        auto hi = files.end();
+        if (from > 0) {
+            lo = std::partition_point(files.begin(), files.end(), [&](const FileInfo& f) { return f.mtime < from; });
+        }
+        if (to > 0) {
+            hi = std::partition_point(lo, files.end(), [&](const FileInfo& f) { return f.mtime <= to; });
+        }
+        size_t range = hi - lo;
+        if (total) *total = range;
+
+        std::vector<FileInfo> result;
+        if (offset >= range) return result;
+        size_t n = std::min(limit, range - offset);
+        result.reserve(n);
+        for (size_t i = 0; i < n; i++) result.push_back(*(hi - 1 - offset - i));
+        return result;
+    }
+};
+
+RecordingCatalog recording_catalog;
+
+// 缩略图与拖动预览雪碧图：录制时从已有的JPEG帧生成，缓存在录像目录的 .thumbs 下，以录像文件名为键
+struct ThumbnailTask {
+    std::string segment;
+    std::vector<uchar> jpeg;
+    bool finish = false;       // 该录像已结束，拼合并写出雪碧图
+};
+
+struct ThumbnailCache {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<ThumbnailTask> tasks;
+    std::thread worker;
+    bool stopping = false;
+    std::string dir;
+    int interval_sec = 10;     // 雪碧图每隔多少秒取一帧
+    int tile_width = 160;
+    int columns = 10;
+
+    // 以下只由工作线程访问
+    std::string segment;
+    std::vector<std::vector<uchar>> tiles;   // 已压缩的小图，结束时再拼合，内存占用很小
+    int tile_height = 0;
+
+    std::string thumb_path(const std::string& name) const {
+        return dir + "/" + name + ".jpg";
+    }
+
+    std::string sprite_path(const std::string& name) const {
+        return dir + "/" + name + ".sprite.jpg";
+    }
+
+    std::string meta_path(const std::string& name) const {
+        return dir + "/" + name + ".sprite.json";
+    }
+
+    void start(const std::string& video_dir) {
+        dir = video_dir + "/.thumbs";
+        mkdir(dir.c_str(), 0755);
+        worker = std::thread(&ThumbnailCache::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    void push(ThumbnailTask task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // 工作线程跟不上时丢弃帧，不能拖慢采集循环
+            if (!task.finish && tasks.size() >= 8) return;
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    void add_frame(const std::string& name, const std::vector<uchar>& jpeg) {
+        ThumbnailTask task;
+        task.segment = name;
+        task.jpeg = jpeg;
+        push(std::move(task));
+    }
+
+    void finish(const std::string& name) {
+        ThumbnailTask task;
+        task.segment = name;
+        task.finish = true;
+        push(std::move(task));
+    }
+
+    void remove(const std::string& name) {
+        unlink(thumb_path(name).c_str());
+        unlink(sprite_path(name).c_str());
+        unlink(meta_path(name).c_str());
+    }
+
+    static void write_file(const std::string& path, const void* data, size_t len) {
+        std::string tmp_path = path + ".tmp";
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out.write((const char*)data, len);
+        out.close();
+        if (out) rename(tmp_path.c_str(), path.c_str());
+    }
+
+    void write_sprite() {
+        if (tiles.empty() || tile_height <= 0) return;
+        int count = tiles.size();
+        int rows = (count + columns - 1) / columns;
+        cv::Mat sprite(rows * tile_height, std::min(count, columns) * tile_width, CV_8UC3, cv::Scalar(0, 0, 0));
+        for (int i = 0; i < count; i++) {
+            cv::Mat tile = cv::imdecode(tiles[i], cv::IMREAD_COLOR);
+            if (tile.cols != tile_width || tile.rows != tile_height) continue;
+            tile.copyTo(sprite(cv::Rect((i % columns) * tile_width, (i / columns) * tile_height, tile_width, tile_height)));
+        }
+        std::vector<uchar> data;
+        if (!cv::imencode(".jpg", sprite, data, {cv::IMWRITE_JPEG_QUALITY, 70})) return;
+        write_file(sprite_path(segment), data.data(), data.size());
+
+        std::ostringstream meta;
+        meta << "{\"interval\":" << interval_sec << ",\"columns\":" << columns << ",\"tiles\":" << count
+             << ",\"tile_width\":" << tile_width << ",\"tile_height\":" << tile_height << "}";
+        std::string json = meta.str();
+        write_file(meta_path(segment), json.data(), json.size());
+    }
+
+    void process(const ThumbnailTask& task) {
+        if (task.segment != segment) {
+            write_sprite();
+            segment = task.segment;
+            tiles.clear();
+        }
+        if (task.finish) {
+            write_sprite();
+            segment.clear();
+            tiles.clear();
+            return;
+        }
+
+        // 解码时直接缩小到1/4，再缩放到固定宽度
+        cv::Mat image = cv::imdecode(task.jpeg, cv::IMREAD_REDUCED_COLOR_4);
+        if (image.empty()) return;
+        if (image.cols != tile_width) {
+            cv::Mat scaled;
+            cv::resize(image, scaled, cv::Size(tile_width, image.rows * tile_width / image.cols), 0, 0, cv::INTER_AREA);
+            image = scaled;
+        }
+        if (!tiles.empty() && image.rows != tile_height) return;
+        tile_height = image.rows;
+
+        std::vector<uchar> tile;
+        if (!cv::imencode(".jpg", image, tile, {cv::IMWRITE_JPEG_QUALITY, 75})) return;
+        // 第一帧同时作为缩略图，录制中的文件也能马上看到
+        if (tiles.empty()) write_file(thumb_path(segment), tile.data(), tile.size());
+        tiles.push_back(std::move(tile));
+    }
+
+    void run() {
+        set_thread_name("thumbs");
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) break;
+            ThumbnailTask task = std::move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            process(task);
+            lock.lock();
+        }
+    }
+};
+
+ThumbnailCache thumbnail_cache;
+
+// 处理目录变化事件，保持索引与磁盘一致，并定期保存索引文件
+void catalog_watch_thread() {
+    set_thread_name("catalog");
+    int fd = recording_catalog.inotify_fd;
+    alignas(struct inotify_event) char buf[16 * 1024];
+    auto last_save = std::chrono::steady_clock::now();
+    
+    while (running) {
+        if (fd < 0) {
+            sleep(1);
+        } else {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 1000) > 0) {
+                std::vector<std::string> changed;
+                bool overflow = false;
+                ssize_t len;
+                while ((len = read(fd, buf, sizeof(buf))) > 0) {
+                    for (char* p = buf; p < buf + len; ) {
+                        struct inotify_event* ev = (struct inotify_event*)p;
+                        if (ev->mask & IN_Q_OVERFLOW) overflow = true;
+                        if (ev->len > 0) changed.push_back(ev->name);
+                        p += sizeof(struct inotify_event) + ev->len;
+                    }
+                }
+                if (overflow) {
+                    recording_catalog.rescan();
+                } else {
+                    // 同一批事件里同一个文件只stat一次
+                    std::sort(changed.begin(), changed.end());
+                    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+                    for (const auto& name : changed) {
+                        recording_catalog.refresh(name);
+                        // 录像被删除（手动、空间清理或外部操作）时一并清理缩略图
+                        if (is_recording_file(name) && access((recording_catalog.dir + "/" + name).c_str(), F_OK) != 0) {
+                            thumbnail_cache.remove(name);
+                            unlink(segment_index_path(recording_catalog.dir + "/" + name).c_str());
+                        }
+                    }
+                }
+            }
+        }
+        
+        if (std::chrono::steady_clock::now() - last_save > std::chrono::seconds(60)) {
+            recording_catalog.save();
+            last_save = std::chrono::steady_clock::now();
+        }
+    }
+    recording_catalog.save();
+    if (fd >= 0) close(fd);
+}
+
+// 后台任务（音视频合成等）：按优先级排队，条件变量唤醒固定数量的工作线程，状态持久化到 .jobs
+struct Job {
+    uint64_t id = 0;
+    std::string type;                  // "merge"：AVI + WAV 合成 MP4
+    int priority = 0;                  // 数值小的先执行
+    std::string state = "queued";      // queued / running / done / failed
+    std::vector<std::string> inputs;
+    std::string output;
+    double progress = 0;               // 0~1，无法估计时为 -1
+    time_t created = 0;
+    time_t finished = 0;
+};
+
+// 按文件大小估算WAV时长（头部没写完也能用），用于计算合成进度
+double wav_duration_sec(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || st.st_size <= 44) return 0;
+    return (st.st_size - 44) / (double)(44100 * 2 * sizeof(int16_t));   // arecord -f cd
+}
+
+int downsample_bitrate = 300000;        // 低码率存档的视频码率
+
+std::vector<std::string> job_command(const Job& job) {
+    if (job.type == "merge" && job.inputs.size() == 2) {
+        return {"ffmpeg", "-y", "-nostdin", "-loglevel", "error", "-nostats", "-progress", "pipe:1",
+                "-threads", "1", "-i", job.inputs[0], "-i", job.inputs[1],
+                "-c:v", "copy", "-c:a", "aac", "-strict", "experimental", job.output};
+    }
+    if (job.type == "downsample" && job.inputs.size() == 1) {
+        return {"ffmpeg", "-y", "-nostdin", "-loglevel", "error", "-nostats", "-progress", "pipe:1",
+                "-threads", "1", "-i", job.inputs[0], "-vf", "scale=-2:360",
+                "-c:v", "libx264", "-preset", "veryfast", "-b:v", std::to_string(downsample_bitrate),
+                "-c:a", "aac", "-b:a", "48k", job.output};
+    }
+    return {};
+}
+
+struct JobScheduler {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string path;
+    std::deque<Job> jobs;                  // 按 id 升序
+    uint64_t next_id = 1;
+    std::vector<std::thread> workers;
+    std::map<uint64_t, pid_t> running_pids;
+    std::atomic<bool> stopping{false};     // 工作线程在锁外执行任务时也会读取
+    int nice_value = 10;                   // 子进程 nice 值
+    double max_load = 0;                   // 1分钟负载超过该值时暂停派发新任务，0 表示不限制
+    size_t keep_finished = 50;             // 保留的已结束任务数
+
+    Job* find_locked(uint64_t id) {
+        for (auto& job : jobs) {
+            if (job.id == id) return &job;
+        }
+        return nullptr;
+    }
+
+    void save_locked() {
+        std::string tmp_path = path + ".tmp";
+        std::ofstream out(tmp_path, std::ios::trunc);
+        for (const auto& job : jobs) {
+            out << job.id << '\t' << job.type << '\t' << job.priority << '\t' << job.state << '\t'
+                << job.created << '\t' << job.finished << '\t' << job.output;
+            for (const auto& input : job.inputs) out << '\t' << input;
+            out << '\n';
+        }
+        out.close();
+        if (out) rename(tmp_path.c_str(), path.c_str());
+    }
+
+    // 读取上次的任务列表，未完成的任务重新排队
+    void load(const std::string& dir) {
+        std::lock_guard<std::mutex> lock(mutex);
+        path = dir + "/.jobs";
+        jobs.clear();
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::vector<std::string> parts;
+            std::string part;
+            while (std::getline(fields, part, '\t')) parts.push_back(part);
+            if (parts.size() < 7) continue;
+            Job job;
+            job.id = std::stoull(parts[0]);
+            job.type = parts[1];
+            job.priority = std::atoi(parts[2].c_str());
+            job.state = parts[3] == "running" ? "queued" : parts[3];
+            job.created = std::atoll(parts[4].c_str());
+            job.finished = std::atoll(parts[5].c_str());
+            job.output = parts[6];
+            job.inputs.assign(parts.begin() + 7, parts.end());
+            next_id = std::max(next_id, job.id + 1);
+            jobs.push_back(job);
+        }
+        size_t pending = std::count_if(jobs.begin(), jobs.end(), [](const Job& job) { return job.state == "queued"; });
+        if (pending > 0) std::cout << "✓ 恢复 " << pending << " 个未完成的后台任务" << std::endl;
+    }
+
+    // 同一输出文件已在队列中或已完成时不重复提交
+    bool submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& existing : jobs) {
+                if (existing.output == job.output && existing.state != "failed") return false;
+            }
+            job.id = next_id++;
+            job.state = "queued";
+            job.created = time(nullptr);
+            jobs.push_back(job);
+            save_locked();
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    bool overloaded() const {
+        double load = 0;
+        return max_load > 0 && getloadavg(&load, 1) == 1 && load > max_load;
+    }
+
+    void start(int count) {
+        for (int i = 0; i < count; i++) workers.emplace_back(&JobScheduler::worker, this);
+        std::cout << "✓ 后台任务线程: " << count << std::endl;
+    }
+
+    // 停止时终止正在运行的ffmpeg，任务下次启动时重新执行
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            for (const auto& item : running_pids) kill(item.second, SIGTERM);
+        }
+        cv.notify_all();
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+    }
+
+    void worker() {
+        set_thread_name("job");
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            Job* next = nullptr;
+            for (auto& job : jobs) {
+                if (job.state == "queued" && (!next || job.priority < next->priority)) next = &job;
+            }
+            if (!next) {
+                cv.wait(lock);
+                continue;
+            }
+            if (overloaded()) {
+                cv.wait_for(lock, std::chrono::seconds(5));
+                continue;
+            }
+
+            next->state = "running";
+            next->progress = 0;
+            Job job = *next;
+            save_locked();
+            lock.unlock();
+
+            uint64_t begin_ns = metric_now_ns();
+            bool ok = execute(job);
+            if (ok) {
+                metric_job_duration.observe_since(begin_ns);
+                metric_jobs_done.add();
+            } else if (!stopping) {
+                metric_jobs_failed.add();
+            }
+
+            lock.lock();
+            Job* done = find_locked(job.id);
+            if (done) {
+                done->state = ok ? "done" : (stopping ? "queued" : "failed");
+                done->progress = ok ? 1 : done->progress;
+                done->finished = ok ? time(nullptr) : 0;
+            }
+            // 只保留最近的已结束任务
+            size_t finished = std::count_if(jobs.begin(), jobs.end(),
+                [](const Job& j) { return j.state == "done" || j.state == "failed"; });
+            for (auto it = jobs.begin(); it != jobs.end() && finished > keep_finished;) {
+                if (it->state == "done" || it->state == "failed") {
+                    it = jobs.erase(it);
+                    finished--;
+                } else {
+                    ++it;
+                }
+            }
+            save_locked();
+        }
+    }
+
+    bool execute(const Job& job) {
+        std::vector<std::string> args = job_command(job);
+        if (args.empty()) return false;
+        std::vector<char*> argv;
+        for (auto& arg : args) argv.push_back((char*)arg.c_str());
+        argv.push_back(nullptr);
+
+        // 子进程只跑在0号核心（采集线程）以外的核心上
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long i = cores > 1 ? 1 : 0; i < cores && i < CPU_SETSIZE; i++) CPU_SET(i, &cpus);
+
+        double total_sec = job.type == "merge" ? wav_duration_sec(job.inputs[1]) : 0;
+        std::cout << "\n→ [后台任务] 开始: " << job.type << " " << job.output << std::endl;
+
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) != 0) return false;
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(pipefd[1], STDOUT_FILENO);
+            int devnull = open("/dev/null", O_WRONLY);
+            if (devnull >= 0) dup2(devnull, STDERR_FILENO);
+            // 降低CPU和磁盘IO优先级（IOPRIO_CLASS_IDLE），合成不会抢占采集和录像写盘
+            setpriority(PRIO_PROCESS, 0, nice_value);
+            syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+            sched_setaffinity(0, sizeof(cpus), &cpus);
+            execvp(argv[0], argv.data());
+            _exit(127);
+        }
+        close(pipefd[1]);
+        if (pid < 0) {
+            close(pipefd[0]);
+            return false;
+        }
+        {
+            // stop() 可能在 fork 之前已经终止过正在运行的任务，这里补上，否则要等它自己跑完
+            std::lock_guard<std::mutex> lock(mutex);
+            running_pids[job.id] = pid;
+            if (stopping) kill(pid, SIGTERM);
+        }
+
+        // 解析 ffmpeg -progress 输出的 out_time_us 计算进度
+        FILE* progress = fdopen(pipefd[0], "r");
+        char line[256];
+        while (progress && fgets(line, sizeof(line), progress)) {
+            long long out_us = 0;
+            if (sscanf(line, "out_time_us=%lld", &out_us) != 1 &&
+                sscanf(line, "out_time_ms=%lld", &out_us) != 1) continue;  // 旧版ffmpeg的 out_time_ms 实为微秒
+            std::lock_guard<std::mutex> lock(mutex);
+            Job* current = find_locked(job.id);
+            if (current) current->progress = total_sec > 0 ? std::min(1.0, out_us / 1e6 / total_sec) : -1;
+        }
+        if (progress) fclose(progress); else close(pipefd[0]);
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running_pids.erase(job.id);
+        }
+
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && access(job.output.c_str(), F_OK) == 0;
+        if (ok) {
+            std::cout << "✓ [后台任务] 完成: " << job.output << std::endl;
+            // 低码率版本沿用原录像的时间，保留策略和列表排序不受影响
+            struct stat st;
+            if (job.type == "downsample" && stat(job.inputs[0].c_str(), &st) == 0) {
+                struct timespec times[2] = {st.st_atim, st.st_mtim};
+                utimensat(AT_FDCWD, job.output.c_str(), times, 0);
+                recording_catalog.refresh(job.output.substr(job.output.rfind('/') + 1));
+            }
+            for (const auto& input : job.inputs) remove(input.c_str());
+        } else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM) {
+            std::cout << "→ [后台任务] 已中断，下次启动时重新执行: " << job.output << std::endl;
+        } else {
+            std::cerr << "✗ [后台任务] 失败，保留原始文件: " << job.output << std::endl;
+        }
+        return ok;
+    }
+
+    // 文件是否被排队中或执行中的任务用到
+    bool uses_file(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& job : jobs) {
+            if (job.state != "queued" && job.state != "running") continue;
+            if (job.output == path) return true;
+            if (std::find(job.inputs.begin(), job.inputs.end(), path) != job.inputs.end()) return true;
+        }
+        return false;
+    }
+
+    std::vector<Job> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::vector<Job>(jobs.begin(), jobs.end());
+    }
+};
+
+JobScheduler job_scheduler;
+
+// 修复断电时未关闭的 MKV：截掉最后一个不完整的簇，补写 Cues、Duration 和 Segment 长度
+bool repair_mkv(const std::string& path) {
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    long long file_size = st.st_size;
+
+    // 在文件头中找到需要回填的位置
+    std::vector<uchar> head(64 * 1024);
+    ssize_t len = pread(fd, head.data(), head.size(), 0);
+    long long segment_size_pos = -1, segment_data_pos = -1, seek_pos = -1, duration_pos = -1, first_cluster = -1;
+    size_t pos = 0;
+    while (len > 0 && pos < (size_t)len) {
+        uint32_t id;
+        uint64_t size;
+        size_t n = ebml_read_id(&head[pos], len - pos, id);
+        size_t m = n > 0 ? ebml_read_size(&head[pos + n], len - pos - n, size) : 0;
+        if (n == 0 || m == 0) break;
+        if (id == 0x18538067) {
+            segment_size_pos = pos + n;
+            segment_data_pos = pos + n + m;
+            pos += n + m;
+            continue;
+        }
+        if (id == 0x1F43B675) {
+            first_cluster = pos;
+            break;
+        }
+        // SeekHead/Seek/Info 是容器，进入内部查找
+        if (id == 0x114D9B74 || id == 0x4DBB || id == 0x1549A966) {
+            pos += n + m;
+            continue;
+        }
+        if (id == 0x53AC && size == 8) seek_pos = pos + n + m;
+        if (id == 0x4489 && size == 8) duration_pos = pos + n + m;
+        if (size == UINT64_MAX) break;
+        pos += n + m + size;
+    }
+    if (segment_data_pos < 0 || first_cluster < 0) {
+        close(fd);
+        return false;
+    }
+
+    // 簇索引中记录了哪些簇以关键帧开始
+    std::map<long long, bool> cue_flags;
+    std::ifstream index(segment_index_path(path));
+    std::string line;
+    while (std::getline(index, line)) {
+        long long ts = 0, offset = 0;
+        int key = 0;
+        if (sscanf(line.c_str(), "%lld\t%lld\t%d", &ts, &offset, &key) == 3) cue_flags[offset] = key != 0;
+    }
+
+    // 逐簇检查完整性
+    std::vector<std::pair<int64_t, long long>> cues;
+    long long end = first_cluster;
+    long long last_cluster = -1;
+    int64_t last_cluster_ts = 0;
+    while (end < file_size) {
+        uchar buf[32];
+        ssize_t got = pread(fd, buf, sizeof(buf), end);
+        uint32_t id = 0, ts_id = 0;
+        uint64_t size = 0, ts_size = 0;
+        size_t n = got > 0 ? ebml_read_id(buf, got, id) : 0;
+        size_t m = n > 0 ? ebml_read_size(buf + n, got - n, size) : 0;
+        if (n == 0 || m == 0 || id == 0x1C53BB6B) break;
+        if (id != 0x1F43B675 || size == UINT64_MAX || end + (long long)(n + m + size) > file_size) break;
+        size_t a = ebml_read_id(buf + n + m, got - n - m, ts_id);
+        size_t b = a > 0 ? ebml_read_size(buf + n + m + a, got - n - m - a, ts_size) : 0;
+        if (ts_id != 0xE7 || b == 0 || ts_size > 8 || n + m + a + b + ts_size > (size_t)got) break;
+        int64_t ts = 0;
+        for (size_t i = 0; i < ts_size; i++) ts = (ts << 8) | buf[n + m + a + b + i];
+
+        auto flag = cue_flags.find(end);
+        if (flag == cue_flags.end() || flag->second) cues.push_back({ts, end - segment_data_pos});
+        last_cluster = end;
+        last_cluster_ts = ts;
+        end += n + m + size;
+    }
+
+    // 已经正常关闭（以 Cues 结尾）的文件不需要修复
+    const uchar cues_id[4] = {0x1C, 0x53, 0xBB, 0x6B};
+    uchar tail[4];
+    if (end < file_size && pread(fd, tail, 4, end) == 4 && memcmp(tail, cues_id, 4) == 0) {
+        close(fd);
+        return true;
+    }
+
+    // 最后一个簇中最大的块时间戳即为时长
+    int64_t duration = last_cluster_ts;
+    if (last_cluster >= 0) {
+        std::vector<uchar> cluster(end - last_cluster);
+        if (pread(fd, cluster.data(), cluster.size(), last_cluster) == (ssize_t)cluster.size()) {
+            uint32_t id;
+            uint64_t size;
+            size_t n = ebml_read_id(cluster.data(), cluster.size(), id);
+            size_t m = ebml_read_size(&cluster[n], cluster.size() - n, size);
+            for (size_t p = n + m; p < cluster.size();) {
+                size_t a = ebml_read_id(&cluster[p], cluster.size() - p, id);
+                size_t b = a > 0 ? ebml_read_size(&cluster[p + a], cluster.size() - p - a, size) : 0;
+                if (a == 0 || b == 0 || p + a + b + size > cluster.size()) break;
+                if (id == 0xA3 && size >= 4) {
+                    int16_t rel = (int16_t)((cluster[p + a + b + 1] << 8) | cluster[p + a + b + 2]);
+                    duration = std::max<int64_t>(duration, last_cluster_ts + rel);
+                }
+                p += a + b + size;
+            }
+        }
+    }
+
+    if (ftruncate(fd, end) != 0) {
+        close(fd);
+        return false;
+    }
+
+    std::vector<uchar> cue_points;
+    for (const auto& cue : cues) {
+        std::vector<uchar> positions;
+        ebml_put_uint(positions, 0xF7, 1);
+        ebml_put_uint(positions, 0xF1, cue.second);
+        std::vector<uchar> point;
+        ebml_put_uint(point, 0xB3, cue.first);
+        ebml_put_master(point, 0xB7, positions);
+        ebml_put_master(cue_points, 0xBB, point);
+    }
+    std::vector<uchar> cues_element;
+    ebml_put_master(cues_element, 0x1C53BB6B, cue_points);
+    bool ok = pwrite(fd, cues_element.data(), cues_element.size(), end) == (ssize_t)cues_element.size();
+    end += cues_element.size();
+
+    uchar buf[8];
+    if (seek_pos >= 0) {
+        put_be64(buf, last_cluster >= 0 ? end - cues_element.size() - segment_data_pos : 0);
+        ok = ok && pwrite(fd, buf, 8, seek_pos) == 8;
+    }
+    if (duration_pos >= 0) {
+        double value = duration + 50.0;
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        put_be64(buf, bits);
+        ok = ok && pwrite(fd, buf, 8, duration_pos) == 8;
+    }
+    std::vector<uchar> size;
+    ebml_put_size8(size, end - segment_data_pos);
+    ok = ok && pwrite(fd, size.data(), size.size(), segment_size_pos) == (ssize_t)size.size();
+    ok = ok && fdatasync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// 修复旧版 arecord 录音的 WAV 头：RIFF 和 data 长度按实际文件大小回填
+bool repair_wav(const std::string& path) {
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    uchar header[44];
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < 44 || pread(fd, header, 44, 0) != 44 ||
+        memcmp(header, "RIFF", 4) != 0 || memcmp(header + 36, "data", 4) != 0) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    uint32_t riff_size = st.st_size - 8;
+    uint32_t data_size = st.st_size - 44;
+    uint32_t old_data_size = header[40] | (header[41] << 8) | (header[42] << 16) | ((uint32_t)header[43] << 24);
+    bool ok = true;
+    if (old_data_size != data_size) {
+        uchar le[4];
+        for (int i = 0; i < 4; i++) le[i] = riff_size >> (8 * i);
+        ok = pwrite(fd, le, 4, 4) == 4;
+        for (int i = 0; i < 4; i++) le[i] = data_size >> (8 * i);
+        ok = ok && pwrite(fd, le, 4, 40) == 4 && fdatasync(fd) == 0;
+        if (ok) std::cout << "✓ 已修复WAV文件头: " << path << std::endl;
+    }
+    close(fd);
+    return ok;
+}
+
+// 启动时修复上次异常退出留下的录像
+void recover_segments(const std::string& dir) {
+    std::ifstream journal(dir + "/.journal");
+    std::string path;
+    int repaired = 0;
+    while (std::getline(journal, path)) {
+        if (path.empty() || access(path.c_str(), F_OK) != 0) continue;
+        if (repair_mkv(path)) {
+            std::cout << "✓ 已修复未正常关闭的录像: " << path << std::endl;
+            repaired++;
+        } else {
+            std::cerr << "✗ 无法修复录像: " << path << std::endl;
+        }
+    }
+    journal.close();
+    unlink((dir + "/.journal").c_str());
+
+    // 旧版录音等待合成前先修正文件头
+    DIR* d = opendir(dir.c_str());
+    if (d) {
+        struct dirent* entry;
+        while ((entry = readdir(d)) != nullptr) {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && name.substr(name.size() - 4) == ".wav") repair_wav(dir + "/" + name);
+        }
+        closedir(d);
+    }
+    if (repaired > 0) std::cout << "✓ 共修复 " << repaired << " 个录像" << std::endl;
+}
+
+// 检查并添加未合成的文件到队列
+void check_unmerged_files(const std::string& dir) {
+    std::cout << "\n→ 检查未合成的视频文件..." << std::endl;
+    
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    
+    std::vector<std::string> avi_files;
+    struct dirent* entry;
+    
+    while ((entry = readdir(d)) != nullptr) {
+        if (entry->d_type == DT_REG) {
+            std::string filename = entry->d_name;
+            if (filename.length() > 4 && filename.substr(filename.length() - 4) == ".avi") {
+                avi_files.push_back(filename);
+            }
+        }
+    }
+    closedir(d);
+    
+    int found_count = 0;
+    for (const auto& avi_file : avi_files) {
+        std::string base_name = avi_file.substr(0, avi_file.length() - 4);
+        std::string wav_file = base_name + ".wav";
+        std::string mp4_file = base_name + ".mp4";
+        
+        std::string avi_path = dir + "/" + avi_file;
+        std::string wav_path = dir + "/" + wav_file;
+        std::string mp4_path = dir + "/" + mp4_file;
+        
+        // 检查是否存在对应的wav文件，且不存在mp4文件
+        if (access(wav_path.c_str(), F_OK) == 0 && access(mp4_path.c_str(), F_OK) != 0) {
+            Job job;
+            job.type = "merge";
+            job.inputs = {avi_path, wav_path};
+            job.output = mp4_path;
+            if (!job_scheduler.submit(job)) continue;
+            found_count++;
+            
+            std::cout << "  + 发现未合成文件: " << avi_file << std::endl;
+        }
+    }
+    
+    if (found_count > 0) {
+        std::cout << "✓ 找到 " << found_count << " 个未合成文件，已加入队列" << std::endl;
+    } else {
+        std::cout << "✓ 没有发现未合成的文件" << std::endl;
+    }
+}
+
+// 运动检测：在1/4缩小的灰度图上做背景差分，背景为 8.8 定点的滑动平均
+struct MotionDetector {
+    int width = 0;
+    int height = 0;
+    std::vector<uint16_t> background;
+    std::vector<uchar> mask;             // 1 表示参与检测的像素
+    std::string zones;                   // "x,y,w,h;-x,y,w,h"，百分比坐标，'-' 开头为排除区域
+    int threshold = 25;                  // 像素亮度变化阈值
+    double min_area = 0.5;               // 变化像素占检测区域的百分比
+    int trigger_frames = 2;              // 连续多少帧超过阈值才算运动
+    int learn_shift = 5;                 // 背景更新速度 1/32
+    int hot_frames = 0;
+    std::atomic<int64_t> last_motion_ms{0};
+    std::atomic<int> score_permille{0};  // 最近一帧的变化比例（千分比）
+
+    void build_mask() {
+        bool any_include = false;
+        std::vector<std::array<int, 5>> rects;
+        std::istringstream list(zones);
+        std::string zone;
+        while (std::getline(list, zone, ';')) {
+            bool exclude = !zone.empty() && zone[0] == '-';
+            int x, y, w, h;
+            if (sscanf(zone.c_str() + (exclude ? 1 : 0), "%d,%d,%d,%d", &x, &y, &w, &h) != 4) continue;
+            rects.push_back({x * width / 100, y * height / 100,
+                             (x + w) * width / 100, (y + h) * height / 100, exclude ? 0 : 1});
+            if (!exclude) any_include = true;
+        }
+
+        mask.assign(width * height, any_include ? 0 : 1);
+        for (int pass = 1; pass >= 0; pass--) {
+            for (const auto& r : rects) {
+                if (r[4] != pass) continue;
+                for (int y = std::max(0, r[1]); y < std::min(height, r[3]); y++) {
+                    for (int x = std::max(0, r[0]); x < std::min(width, r[2]); x++) {
+                        mask[y * width + x] = pass;
+                    }
+                }
+            }
+        }
+    }
+
+    // 返回本帧变化像素的比例（百分比）
+    double update(const cv::Mat& gray) {
+        if (gray.empty()) return 0;
+        if (gray.cols != width || gray.rows != height || background.empty()) {
+            width = gray.cols;
+            height = gray.rows;
+            build_mask();
+            background.resize(width * height);
+            for (int y = 0; y < height; y++) {
+                const uchar* row = gray.ptr<uchar>(y);
+                for (int x = 0; x < width; x++) background[y * width + x] = row[x] << 8;
+            }
+            return 0;
+        }
+
+        // 逐行处理，循环体无分支，便于编译器向量化
+        int changed = 0;
+        int active = 0;
+        for (int y = 0; y < height; y++) {
+            const uchar* row = gray.ptr<uchar>(y);
+            uint16_t* bg = &background[y * width];
+            const uchar* m = &mask[y * width];
+            for (int x = 0; x < width; x++) {
+                int pixel = row[x] << 8;
+                int diff = std::abs(pixel - bg[x]) >> 8;
+                changed += (diff > threshold) & m[x];
+                active += m[x];
+                bg[x] = bg[x] + ((pixel - bg[x]) >> learn_shift);
+            }
+        }
+        if (active == 0) return 0;
+
+        double percent = changed * 100.0 / active;
+        score_permille = (int)(percent * 10);
+        // 大面积同时变化通常是开关灯或自动曝光，直接重建背景
+        if (percent > 60) {
+            background.clear();
+            hot_frames = 0;
+            return percent;
+        }
+        hot_frames = percent >= min_area ? hot_frames + 1 : 0;
+        if (hot_frames >= trigger_frames) last_motion_ms = steady_ms();
+        return percent;
+    }
+
+    // 最近 hold_ms 内是否检测到运动
+    bool active(int64_t hold_ms) const {
+        int64_t last = last_motion_ms;
+        return last > 0 && steady_ms() - last < hold_ms;
+    }
+};
+
+// 运动事件索引，保存在录像目录下的 .events（制表符分隔）
+struct MotionEvent {
+    time_t start = 0;
+    time_t end = 0;
+    int peak_permille = 0;
+    std::string file;
+    std::string kind = "motion";        // motion / sound（响度触发）
+};
+
+struct MotionEventLog {
+    std::mutex mutex;
+    std::string path;
+    std::vector<MotionEvent> events;    // 按开始时间升序
+
+    void load(const std::string& dir) {
+        std::lock_guard<std::mutex> lock(mutex);
+        path = dir + "/.events";
+        events.clear();
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            MotionEvent event;
+            if (fields >> event.start >> event.end >> event.peak_permille) {
+                fields.get();
+                std::getline(fields, event.file);
+                // 旧版没有事件类型列
+                size_t tab = event.file.find('\t');
+                if (tab != std::string::npos) {
+                    event.kind = event.file.substr(tab + 1);
+                    event.file.erase(tab);
+                }
+                events.push_back(event);
+            }
+        }
+    }
+
+    void append(const MotionEvent& event) {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(event);
+        std::ofstream out(path, std::ios::app);
+        out << event.start << '\t' << event.end << '\t' << event.peak_permille << '\t' << event.file
+            << '\t' << event.kind << '\n';
+    }
+
+    // 按时间范围查询，最新的在前
+    std::vector<MotionEvent> list(time_t from, time_t to, size_t limit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<MotionEvent> result;
+        for (auto it = events.rbegin(); it != events.rend() && result.size() < limit; ++it) {
+            if (from > 0 && it->end < from) continue;
+            if (to > 0 && it->start > to) continue;
+            result.push_back(*it);
+        }
+        return result;
+    }
+};
+
+MotionEventLog motion_events;
+
+// 解析带单位的容量：500M、20G、1T，纯数字为字节
+long long parse_size(const std::string& value) {
+    char* end = nullptr;
+    double number = strtod(value.c_str(), &end);
+    switch (end ? toupper(*end) : 0) {
+        case 'K': return number * 1024LL;
+        case 'M': return number * 1024LL * 1024;
+        case 'G': return number * 1024LL * 1024 * 1024;
+        case 'T': return number * 1024LL * 1024 * 1024 * 1024;
+        default: return number;
+    }
+}
+
+// 录像保留策略：过期删除、容量上限、最小剩余空间，运动事件录像保留更久，旧录像可转为低码率
+struct RetentionPolicy {
+    int max_age_days = 0;               // 0 表示不按时间删除
+    int event_max_age_days = 0;         // 运动事件录像的保留天数，0 表示与 max_age_days 相同
+    long long max_bytes = 0;            // 录像总量上限，0 表示不限
+    long long min_free_bytes = 500LL * 1024 * 1024;
+    int downsample_after_days = 0;      // 超过该天数的录像转码为低码率版本，0 表示不转码
+};
+
+struct RetentionManager {
+    std::mutex mutex;
+    std::condition_variable cv;
+    RetentionPolicy policy;
+    std::string dir;
+    std::map<std::string, std::string> active_files;     // 各摄像头正在录制的文件，不能删除
+    std::map<std::string, long long> camera_max_bytes;   // 各摄像头的录像总量上限，键为文件名前缀（第一路为空）
+    bool triggered = false;
+    bool stopping = false;
+    int interval_sec = 60;
+
+    void set_active(const std::string& camera, const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        active_files[camera] = path;
+    }
+
+    // 请求尽快执行一次清理（例如切换录像文件时）
+    void trigger() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            triggered = true;
+        }
+        cv.notify_one();
+    }
+
+    static bool is_downsampled(const std::string& name) {
+        return name.find("_low.") != std::string::npos;
+    }
+
+    // 一次清理：对按时间排序的录像列表只遍历，不重复列目录和排序
+    void sweep() {
+        std::set<std::string> active;   // 按文件名比较，不受路径写法影响
+        std::map<std::string, long long> quotas;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& item : active_files) {
+                if (!item.second.empty()) active.insert(item.second.substr(item.second.rfind('/') + 1));
+            }
+            quotas = camera_max_bytes;
+        }
+
+        std::set<std::string> event_files;
+        for (const auto& event : motion_events.list(0, 0, SIZE_MAX)) event_files.insert(event.file);
+
+        std::vector<FileInfo> files = recording_catalog.list(0, SIZE_MAX, 0, 0);
+        std::reverse(files.begin(), files.end());   // 最旧的在前
+
+        time_t now = time(nullptr);
+        long long total_bytes = 0;
+        std::map<std::string, long long> camera_bytes;
+        for (const auto& file : files) {
+            total_bytes += file.size;
+            camera_bytes[recording_camera(file.name)] += file.size;
+        }
+        long long free_bytes = get_free_disk_space(dir);
+
+        // 各摄像头最新的录像可能刚切换文件、尚未登记为正在录制，容量清理时同样保留
+        std::map<std::string, const FileInfo*> newest;
+        for (const auto& file : files) newest[recording_camera(file.name)] = &file;
+
+        std::vector<const FileInfo*> deletions;
+        std::vector<const FileInfo*> normal;
+        std::vector<const FileInfo*> events;
+        for (const auto& file : files) {
+            // 正在录制、等待合成或正在转码的文件不动
+            if (active.count(file.name) || job_scheduler.uses_file(file.path)) continue;
+            bool is_event = event_files.count(file.name) > 0 || file.name.find("_motion") != std::string::npos;
+            int max_age = is_event && policy.event_max_age_days > 0 ? policy.event_max_age_days : policy.max_age_days;
+            int age_days = (now - file.mtime) / 86400;
+            if (max_age > 0 && age_days >= max_age) {
+                deletions.push_back(&file);
+                camera_bytes[recording_camera(file.name)] -= file.size;
+                continue;
+            }
+            if (!is_event && policy.downsample_after_days > 0 && age_days >= policy.downsample_after_days &&
+                !is_downsampled(file.name) && file.name.size() > 4 && file.name.substr(file.name.size() - 4) == ".mkv") {
+                Job job;
+                job.type = "downsample";
+                job.priority = 10;
+                job.inputs = {file.path};
+                job.output = file.path.substr(0, file.path.size() - 4) + "_low.mkv";
+                job_scheduler.submit(job);
+                continue;
+            }
+            (is_event ? events : normal).push_back(&file);
+        }
+
+        // 容量不足时先删普通录像，再删事件录像，都从最旧的开始
+        // 先让超出自身配额的摄像头删除，再按总量和剩余空间删除
+        long long freed = 0;
+        for (const FileInfo* file : deletions) freed += file->size;
+        std::set<const FileInfo*> chosen;
+        for (auto* list : {&normal, &events}) {
+            for (const FileInfo* file : *list) {
+                std::string camera = recording_camera(file->name);
+                if (newest[camera] == file) continue;
+                auto quota = quotas.find(camera);
+                if (quota == quotas.end() || quota->second <= 0 || camera_bytes[camera] <= quota->second) continue;
+                deletions.push_back(file);
+                chosen.insert(file);
+                freed += file->size;
+                camera_bytes[camera] -= file->size;
+            }
+        }
+        auto over_quota = [&]() {
+            return (policy.max_bytes > 0 && total_bytes - freed > policy.max_bytes) ||
+                   (free_bytes >= 0 && free_bytes + freed < policy.min_free_bytes);
+        };
+        for (auto* list : {&normal, &events}) {
+            for (const FileInfo* file : *list) {
+                if (!over_quota()) break;
+                if (chosen.count(file) || newest[recording_camera(file->name)] == file) continue;
+                deletions.push_back(file);
+                freed += file->size;
+            }
+        }
+
+        int deleted = 0;
+        for (const FileInfo* file : deletions) {
+            if (remove(file->path.c_str()) == 0) {
+                recording_catalog.remove(file->name);
+                deleted++;
+                metric_retention_deleted.add();
+                metric_retention_freed.add(file->size);
+            }
+        }
+        if (deleted > 0) {
+            std::cout << "✓ 清理旧录像 " << deleted << " 个，释放 " << format_size(freed) << std::endl;
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running && !stopping) {
+            cv.wait_for(lock, std::chrono::seconds(interval_sec), [this] { return triggered || stopping || !running; });
+            if (stopping || !running) break;
+            triggered = false;
+            lock.unlock();
+            sweep();
+            lock.lock();
+        }
+    }
+
+    // 在锁内置位再通知，清理线程无论是否已进入等待都不会错过
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+    }
+};
+
+RetentionManager retention_manager;
+
+void retention_thread() {
+    set_thread_name("retention");
+    retention_manager.run();
+}
+
+// 查询参数值的百分号编码，只保留 RFC 3986 的非保留字符
+std::string url_encode(const std::string& str) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string result;
+    result.reserve(str.size());
+    for (unsigned char c : str) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            result += c;
+        } else {
+            result += '%';
+            result += hex[c >> 4];
+            result += hex[c & 15];
+        }
+    }
+    return result;
+}
+
+std::string url_decode(const std::string& str) {
+    std::string result;
+    for (size_t i = 0; i < str.length(); i++) {
+        if (str[i] == '%' && i + 2 < str.length()) {
+            int value;
+            std::istringstream is(str.substr(i + 1, 2));
+            if (is >> std::hex >> value) {
+                result += static_cast<char>(value);
+                i += 2;
+            } else {
+                result += str[i];
+            }
+        } else if (str[i] == '+') {
+            result += ' ';
+        } else {
+            result += str[i];
+        }
+    }
+    return result;
+}
+
+// 页面模板：首次使用时读入内存并按 {{占位符}} 切分，之后每次只做一遍拼接；文件被修改时自动重新加载
+struct PageTemplate {
+    std::string path;
+    time_t mtime = 0;
+    std::vector<std::string> literals;  // literals.size() == keys.size() + 1
+    std::vector<std::string> keys;
+
+    bool load() {
+        struct stat file_stat;
+        if (stat(path.c_str(), &file_stat) != 0) return false;
+        if (!literals.empty() && file_stat.st_mtime == mtime) return true;
+
+        std::ifstream file(path);
+        if (!file.is_open()) return false;
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        std::string html = buffer.str();
+
+        literals.clear();
+        keys.clear();
+        size_t pos = 0;
+        while (true) {
+            size_t open = html.find("{{", pos);
+            size_t close = open == std::string::npos ? open : html.find("}}", open + 2);
+            if (close == std::string::npos) {
+                literals.push_back(html.substr(pos));
+                break;
+            }
+            literals.push_back(html.substr(pos, open - pos));
+            keys.push_back(html.substr(open + 2, close - open - 2));
+            pos = close + 2;
+        }
+        mtime = file_stat.st_mtime;
+        return true;
+    }
+
+    std::string render(const std::map<std::string, std::string>& values) const {
+        size_t total = 0;
+        for (const auto& literal : literals) total += literal.size();
+        for (const auto& key : keys) {
+            auto it = values.find(key);
+            if (it != values.end()) total += it->second.size();
+        }
+
+        std::string result;
+        result.reserve(total);
+        for (size_t i = 0; i < keys.size(); i++) {
+            result += literals[i];
+            auto it = values.find(keys[i]);
+            if (it != values.end()) result += it->second;
+        }
+        result += literals.back();
+        return result;
+    }
+};
+
+PageTemplate index_template;
+const size_t files_page_size = 100;
+
+// HTML 文本和属性值转义，单双引号都转义，放进哪种引号的属性里都安全
+std::string html_escape(const std::string& str) {
+    std::string result;
+    result.reserve(str.size());
+    for (char c : str) {
+        switch (c) {
+            case '&': result += "&amp;"; break;
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            case '"': result += "&quot;"; break;
+            case '\'': result += "&#39;"; break;
+            default: result += c;
+        }
+    }
+    return result;
+}
+
+std::string json_escape(const std::string& str) {
+    std::string result;
+    result.reserve(str.size() + 2);
+    for (char c : str) {
+        switch (c) {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    result += buf;
+                } else {
+                    result += c;
+                }
+        }
+    }
+    return result;
+}
+
+// 按时间截取片段：从各录像的簇索引定位起点，跨文件按簇原样拷贝（不重新编码），边读边发
+struct ClipSource {
+    std::string path;
+    int64_t start_ms = 0;       // 录像内时间戳0对应的墙上时间
+    long long begin_pos = 0;    // 第一个要输出的簇在文件中的位置
+};
+
+// 读取录像开头，取出 Tracks 元素和第一个簇的位置
+bool read_mkv_head(int fd, std::string& tracks, long long& first_cluster) {
+    std::vector<uchar> buf(64 * 1024);
+    ssize_t len = pread(fd, buf.data(), buf.size(), 0);
+    if (len <= 0) return false;
+    size_t pos = 0;
+    bool in_segment = false;
+    tracks.clear();
+    while (pos < (size_t)len) {
+        uint32_t id;
+        uint64_t size;
+        size_t n = ebml_read_id(&buf[pos], len - pos, id);
+        if (n == 0) return false;
+        size_t m = ebml_read_size(&buf[pos + n], len - pos - n, size);
+        if (m == 0) return false;
+        if (id == 0x18538067) {
+            in_segment = true;
+            pos += n + m;
+            continue;
+        }
+        if (in_segment && id == 0x1F43B675) {
+            first_cluster = pos;
+            return !tracks.empty();
+        }
+        if (size == UINT64_MAX || pos + n + m + size > (size_t)len) return false;
+        if (id == 0x1654AE6B) tracks.assign((const char*)&buf[pos], n + m + size);
+        pos += n + m + size;
+    }
+    return false;
+}
+
+struct ClipProducer {
+    std::vector<ClipSource> sources;
+    size_t current = 0;
+    int fd = -1;
+    long long pos = 0;
+    long long file_size = 0;
+    int64_t end_ms = 0;          // 截取终点（墙上时间）
+    int64_t origin_ms = -1;      // 输出时间戳0对应的墙上时间
+    std::string pending;         // 尚未取走的输出（头部）
+
+    ~ClipProducer() {
+        if (fd >= 0) close(fd);
+    }
+
+    // 选出 camera（第一路为空）的与 [from, to] 重叠且轨道一致的录像，生成输出头部
+    bool prepare(time_t from, time_t to, const std::string& camera = "") {
+        end_ms = to * 1000LL;
+        // 目录按修改时间（即录像结束时间）排序，from 之后结束的录像都可能与区间重叠，不能限制条数
+        std::vector<FileInfo> files = recording_catalog.list(0, SIZE_MAX, from, 0);
+        std::vector<std::pair<int64_t, ClipSource>> candidates;
+        std::string tracks;
+        for (auto it = files.rbegin(); it != files.rend(); ++it) {
+            const FileInfo& file = *it;
+            if (file.name.size() < 4 || file.name.substr(file.name.size() - 4) != ".mkv") continue;
+            if (recording_camera(file.name) != camera) continue;
+            struct tm tm = {};
+            size_t time_start = camera.empty() ? 0 : camera.size() + 1;
+            if (!strptime(file.name.c_str() + time_start, "%Y-%m-%d_%H-%M-%S", &tm)) continue;
+            tm.tm_isdst = -1;
+            time_t name_time = mktime(&tm);
+            // 运动录像含预录，文件名时间可能比实际开头晚几秒
+            if (name_time - 60 > to) continue;
+
+            ClipSource source;
+            source.path = file.path;
+            source.start_ms = name_time * 1000LL;
+            std::vector<std::pair<int64_t, long long>> keys;   // (时间戳, 簇位置)，只含关键帧开头的簇
+            std::ifstream index(segment_index_path(file.path));
+            std::string line;
+            while (std::getline(index, line)) {
+                long long a = 0, b = 0;
+                int key = 0;
+                if (sscanf(line.c_str(), "start\t%lld", &a) == 1) {
+                    source.start_ms = a;
+                } else if (sscanf(line.c_str(), "%lld\t%lld\t%d", &a, &b, &key) == 3 && key) {
+                    keys.push_back({a, b});
+                }
+            }
+            if (source.start_ms > end_ms) continue;
+
+            int file_fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (file_fd < 0) continue;
+            std::string file_tracks;
+            bool ok = read_mkv_head(file_fd, file_tracks, source.begin_pos);
+            close(file_fd);
+            if (!ok) continue;
+            // 编码参数不同的录像无法直接拼接
+            if (!tracks.empty() && file_tracks != tracks) continue;
+
+            if (tracks.empty()) {
+                tracks = file_tracks;
+                for (const auto& key : keys) {
+                    if (source.start_ms + key.first > from * 1000LL) break;
+                    source.begin_pos = key.second;
+                }
+            }
+            sources.push_back(source);
+        }
+        if (sources.empty()) return false;
+
+        // 输出为流式 Matroska：Segment 长度未知，不写 Cues
+        std::vector<uchar> head;
+        std::vector<uchar> ebml;
+        ebml_put_uint(ebml, 0x4286, 1);
+        ebml_put_uint(ebml, 0x42F7, 1);
+        ebml_put_uint(ebml, 0x42F2, 4);
+        ebml_put_uint(ebml, 0x42F3, 8);
+        ebml_put_string(ebml, 0x4282, "matroska");
+        ebml_put_uint(ebml, 0x4287, 4);
+        ebml_put_uint(ebml, 0x4285, 2);
+        ebml_put_master(head, 0x1A45DFA3, ebml);
+        ebml_put_id(head, 0x18538067);
+        head.push_back(0x01);
+        head.insert(head.end(), 7, 0xFF);
+        std::vector<uchar> info;
+        ebml_put_uint(info, 0x2AD7B1, 1000000);
+        ebml_put_string(info, 0x4D80, "video_recorder");
+        ebml_put_string(info, 0x5741, "video_recorder");
+        ebml_put_master(head, 0x1549A966, info);
+        pending.assign((const char*)head.data(), head.size());
+        pending += tracks;
+        return true;
+    }
+
+    // 取出下一块输出（约256KB），全部输出完后返回false
+    bool next(std::string& out) {
+        out.swap(pending);
+        pending.clear();
+        std::vector<uchar> buf;
+        while (out.size() < 256 * 1024) {
+            if (fd < 0) {
+                if (current >= sources.size()) return false;
+                fd = open(sources[current].path.c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat st;
+                if (fd < 0 || fstat(fd, &st) != 0) {
+                    if (fd >= 0) close(fd);
+                    fd = -1;
+                    current++;
+                    continue;
+                }
+                pos = sources[current].begin_pos;
+                file_size = st.st_size;
+            }
+
+            // 簇头 + 时间戳元素
+            uchar head[32];
+            ssize_t len = pread(fd, head, sizeof(head), pos);
+            uint32_t id = 0;
+            uint64_t size = 0;
+            size_t n = len > 0 ? ebml_read_id(head, len, id) : 0;
+            size_t m = n > 0 ? ebml_read_size(head + n, len - n, size) : 0;
+            if (n == 0 || m == 0 || id != 0x1F43B675 || size == UINT64_MAX || pos + (long long)(n + m + size) > file_size) {
+                // 到达文件末尾（Cues 或正在写入的簇）
+                close(fd);
+                fd = -1;
+                current++;
+                continue;
+            }
+            buf.resize(size);
+            if (pread(fd, buf.data(), size, pos + n + m) != (ssize_t)size) {
+                close(fd);
+                fd = -1;
+                current++;
+                continue;
+            }
+            pos += n + m + size;
+
+            uint32_t ts_id = 0;
+            uint64_t ts_size = 0;
+            size_t a = ebml_read_id(buf.data(), buf.size(), ts_id);
+            size_t b = a > 0 ? ebml_read_size(&buf[a], buf.size() - a, ts_size) : 0;
+            if (ts_id != 0xE7 || b == 0 || ts_size > 8 || a + b + ts_size > buf.size()) continue;
+            uint64_t ts = 0;
+            for (size_t i = 0; i < ts_size; i++) ts = (ts << 8) | buf[a + b + i];
+
+            int64_t abs_ms = sources[current].start_ms + (int64_t)ts;
+            if (abs_ms > end_ms) {
+                close(fd);
+                fd = -1;
+                current = sources.size();
+                continue;
+            }
+            if (origin_ms < 0) origin_ms = abs_ms;
+
+            // 重写簇时间戳，块内相对时间戳不变
+            std::vector<uchar> body;
+            ebml_put_uint(body, 0xE7, std::max<int64_t>(0, abs_ms - origin_ms));
+            size_t rest = a + b + ts_size;
+            std::vector<uchar> cluster_head;
+            ebml_put_id(cluster_head, 0x1F43B675);
+            ebml_put_size(cluster_head, body.size() + buf.size() - rest);
+            out.append((const char*)cluster_head.data(), cluster_head.size());
+            out.append((const char*)body.data(), body.size());
+            out.append((const char*)buf.data() + rest, buf.size() - rest);
+        }
+        return true;
+    }
+};
+
+// 解析截取时间：Unix时间戳，或本地时间 2024-01-02T14:32:00 / 2024-01-02 14:32 / 2024-01-02_14-32-00
+time_t parse_clip_time(const std::string& value) {
+    if (value.empty()) return -1;
+    if (value.find_first_not_of("0123456789") == std::string::npos) return std::atoll(value.c_str());
+    const char* formats[] = {"%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S", "%Y-%m-%d_%H-%M-%S",
+                             "%Y-%m-%dT%H:%M", "%Y-%m-%d %H:%M"};
+    for (const char* format : formats) {
+        struct tm tm = {};
+        const char* end = strptime(value.c_str(), format, &tm);
+        if (end && *end == '\0') {
+            tm.tm_isdst = -1;
+            return mktime(&tm);
+        }
+    }
+    return -1;
+}
+
+// 待发送的数据块，持有共享缓冲区的引用（JPEG帧无需拷贝）
+struct OutChunk {
+    std::shared_ptr<const void> owner;
+    const char* data;
+    size_t len;
+};
+
+struct HttpConnection {
+    int fd = -1;
+    std::string in_buf;
+    std::deque<OutChunk> out_queue;
+    size_t out_offset = 0;          // 队首数据块已发送的字节数
+    size_t out_bytes = 0;           // 队列中尚未发送的字节数
+    int file_fd = -1;               // 正在下载的文件
+    long long file_offset = 0;
+    long long file_remaining = 0;
+    bool keep_alive = true;
+    bool streaming = false;         // /stream 长连接
+    int stream_cam = 0;             // 观看的摄像头序号
+    uint64_t stream_seq = 0;        // 已发送的最新帧序号
+    int stream_tier = 0;            // 当前使用的画质档位
+    int stream_best_tier = 0;       // 客户端请求的最高档位，网络好转时最多升回这一档
+    int stream_interval_ms = 0;     // 客户端限定的最小帧间隔
+    int64_t stream_last_ms = 0;     // 上一帧入队时间
+    int stream_offered = 0;         // 当前统计窗口内到期的帧数
+    int stream_dropped = 0;         // 其中因上一帧未发完而跳过的帧数
+    int stream_good_windows = 0;    // 连续无丢帧的统计窗口数
+    int64_t stream_window_start = 0;
+    uint64_t stream_last_offered = 0; // 已计入统计的最新帧序号
+    bool epollout = false;          // 是否已注册可写事件
+    time_t last_active = 0;
+    std::shared_ptr<ClipProducer> clip;  // 正在以分块传输发送的截取片段
+    bool waiting_playlist = false;  // 阻塞式HLS播放列表请求，等待指定的分段出现
+    int wait_cam = 0;               // 播放列表所属的摄像头序号
+    int64_t wait_msn = 0;
+    int64_t wait_part = -1;
+    time_t wait_deadline = 0;
+
+    void queue(std::string data) {
+        if (data.empty()) return;
+        auto owned = std::make_shared<std::string>(std::move(data));
+        out_bytes += owned->size();
+        out_queue.push_back({owned, owned->data(), owned->size()});
+    }
+
+    void queue_frame(const std::shared_ptr<const JpegFrame>& frame) {
+        std::ostringstream frame_header;
+        frame_header << "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " 
+                    << frame->data.size() << "\r\n\r\n";
+        queue(frame_header.str());
+        out_bytes += frame->data.size();
+        out_queue.push_back({frame, (const char*)frame->data.data(), frame->data.size()});
+        queue("\r\n");
+        stream_seq = frame->seq;
+    }
+
+    void queue_shared(const std::shared_ptr<const std::string>& data) {
+        out_bytes += data->size();
+        out_queue.push_back({data, data->data(), data->size()});
+    }
+
+    bool busy() const {
+        return !out_queue.empty() || file_remaining > 0 || waiting_playlist || clip;
+    }
+};
+
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::string query;
+    std::string version;
+    std::map<std::string, std::string> headers;  // 键为小写
+};
+
+bool parse_http_request(const std::string& head, HttpRequest& req) {
+    std::istringstream stream(head);
+    std::string line;
+    if (!std::getline(stream, line)) return false;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+
+    std::istringstream request_line(line);
+    std::string target;
+    if (!(request_line >> req.method >> target >> req.version)) return false;
+
+    size_t qpos = target.find('?');
+    req.path = target.substr(0, qpos);
+    req.query = qpos == std::string::npos ? "" : target.substr(qpos + 1);
+
+    while (std::getline(stream, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string key = line.substr(0, colon);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        size_t vstart = line.find_first_not_of(" \t", colon + 1);
+        req.headers[key] = vstart == std::string::npos ? "" : line.substr(vstart);
+    }
+    return true;
+}
+
+std::string get_header(const HttpRequest& req, const std::string& key) {
+    auto it = req.headers.find(key);
+    return it == req.headers.end() ? "" : it->second;
+}
+
+std::string get_query_param(const std::string& query, const std::string& key) {
+    size_t pos = 0;
+    while (pos <= query.length()) {
+        size_t end = query.find('&', pos);
+        if (end == std::string::npos) end = query.length();
+        std::string pair = query.substr(pos, end - pos);
+        size_t eq = pair.find('=');
+        if (pair.substr(0, eq) == key) {
+            return eq == std::string::npos ? "" : url_decode(pair.substr(eq + 1));
+        }
+        pos = end + 1;
+    }
+    return "";
+}
+
+long long get_query_int(const std::string& query, const std::string& key, long long default_value) {
+    std::string value = get_query_param(query, key);
+    if (value.empty()) return default_value;
+    char* end = nullptr;
+    long long result = std::strtoll(value.c_str(), &end, 10);
+    return *end == '\0' ? result : default_value;
+}
+
+const char* http_status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 206: return "Partial Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 416: return "Range Not Satisfiable";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+void send_http_response(HttpConnection& conn, const std::string& content_type, const std::string& body, int status = 200) {
+    std::ostringstream response;
+    response << "HTTP/1.1 " << status << " " << http_status_text(status) << "\r\n";
+    response << "Content-Type: " << content_type << "\r\n";
+    response << "Content-Length: " << body.length() << "\r\n";
+    response << "Connection: " << (conn.keep_alive ? "keep-alive" : "close") << "\r\n\r\n" << body;
+    conn.queue(response.str());
+}
+
+std::string format_http_date(time_t t) {
+    char buf[64];
+    struct tm tm_buf;
+    std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm_buf));
+    return std::string(buf);
+}
+
+time_t parse_http_date(const std::string& str) {
+    struct tm tm_buf;
+    memset(&tm_buf, 0, sizeof(tm_buf));
+    if (!strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm_buf)) return -1;
+    return timegm(&tm_buf);
+}
+
+// 解析单段 Range: bytes=start-end / bytes=start- / bytes=-suffix
+// 返回 1 表示有效范围，0 表示无Range或不支持的格式（按完整文件处理），-1 表示范围无法满足
+int parse_range(const std::string& range, long long file_size, long long& start, long long& end) {
+    if (range.compare(0, 6, "bytes=") != 0) return 0;
+    std::string spec = range.substr(6);
+    if (spec.find(',') != std::string::npos) return 0;
+    
+    size_t dash = spec.find('-');
+    if (dash == std::string::npos) return 0;
+    std::string first = spec.substr(0, dash);
+    std::string last = spec.substr(dash + 1);
+    if (first.empty() && last.empty()) return 0;
+    if (first.find_first_not_of("0123456789") != std::string::npos ||
+        last.find_first_not_of("0123456789") != std::string::npos) return 0;
+    
+    if (first.empty()) {
+        long long suffix = std::strtoll(last.c_str(), nullptr, 10);
+        if (suffix == 0 || file_size == 0) return -1;
+        start = std::max(0LL, file_size - suffix);
+        end = file_size - 1;
+        return 1;
+    }
+    
+    start = std::strtoll(first.c_str(), nullptr, 10);
+    end = last.empty() ? file_size - 1 : std::min(std::strtoll(last.c_str(), nullptr, 10), file_size - 1);
+    if (start >= file_size || start > end) return -1;
+    return 1;
+}
+
+// 文件下载：支持 Range/206 断点续传与 ETag/Last-Modified 缓存校验，正文由 sendfile 零拷贝发送
+// inline_type 非空时按该类型内联返回（缩略图等），并允许浏览器缓存
+void send_file_download(HttpConnection& conn, const HttpRequest& req, const std::string& filepath, const std::string& filename,
+                        const char* inline_type = nullptr) {
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        if (fd >= 0) close(fd);
+        send_http_response(conn, "text/plain", "File not found", 404);
+        return;
+    }
+    
+    long long file_size = file_stat.st_size;
+    std::ostringstream etag_stream;
+    etag_stream << "\"" << std::hex << file_size << "-" << file_stat.st_mtime << "\"";
+    std::string etag = etag_stream.str();
+    std::string last_modified = format_http_date(file_stat.st_mtime);
+    
+    // 缓存校验：If-None-Match 优先于 If-Modified-Since
+    std::string if_none_match = get_header(req, "if-none-match");
+    std::string if_modified_since = get_header(req, "if-modified-since");
+    bool not_modified = false;
+    if (!if_none_match.empty()) {
+        not_modified = if_none_match == "*" || if_none_match.find(etag) != std::string::npos;
+    } else if (!if_modified_since.empty()) {
+        time_t since = parse_http_date(if_modified_since);
+        not_modified = since != -1 && file_stat.st_mtime <= since;
+    }
+    if (not_modified) {
+        close(fd);
+        std::ostringstream header;
+        header << "HTTP/1.1 304 Not Modified\r\n";
+        header << "ETag: " << etag << "\r\n";
+        header << "Last-Modified: " << last_modified << "\r\n";
+        header << "Connection: " << (conn.keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+        conn.queue(header.str());
+        return;
+    }
+    
+    long long start = 0;
+    long long end = file_size - 1;
+    int range_result = 0;
+    std::string range = get_header(req, "range");
+    std::string if_range = get_header(req, "if-range");
+    // If-Range 与当前文件不一致时忽略 Range，返回完整文件
+    if (!range.empty() && (if_range.empty() || if_range == etag || if_range == last_modified)) {
+        range_result = parse_range(range, file_size, start, end);
+    }
+    
+    if (range_result < 0) {
+        close(fd);
+        std::ostringstream header;
+        header << "HTTP/1.1 416 Range Not Satisfiable\r\n";
+        header << "Content-Range: bytes */" << file_size << "\r\n";
+        header << "Content-Length: 0\r\n";
+        header << "Connection: " << (conn.keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+        conn.queue(header.str());
+        return;
+    }
+    
+    long long content_length = file_size == 0 ? 0 : end - start + 1;
+    
+    // 发送响应头，文件内容在连接可写时分块发送
+    std::ostringstream header;
+    if (range_result > 0) {
+        header << "HTTP/1.1 206 Partial Content\r\n";
+        header << "Content-Range: bytes " << start << "-" << end << "/" << file_size << "\r\n";
+    } else {
+        header << "HTTP/1.1 200 OK\r\n";
+    }
+    if (inline_type) {
+        header << "Content-Type: " << inline_type << "\r\n";
+        header << "Cache-Control: public, max-age=86400\r\n";
+    } else {
+        header << "Content-Type: application/octet-stream\r\n";
+        header << "Content-Disposition: attachment; filename=\"" << filename << "\"\r\n";
+    }
+    header << "Content-Length: " << content_length << "\r\n";
+    header << "Accept-Ranges: bytes\r\n";
+    header << "ETag: " << etag << "\r\n";
+    header << "Last-Modified: " << last_modified << "\r\n";
+    header << "Connection: " << (conn.keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+    conn.queue(header.str());
+    
+    if (content_length == 0) {
+        close(fd);
+        return;
+    }
+    conn.file_fd = fd;
+    conn.file_offset = start;
+    conn.file_remaining = content_length;
+}
+
+// 预览画质档位：0 档为摄像头原始JPEG，其余档位由 stream_tier_thread 缩放重编码，所有观看者共享
+struct StreamTier {
+    int width;      // 0 表示原始尺寸
+    int quality;
+};
+
+const int STREAM_TIERS = 4;
+const StreamTier stream_tier_ladder[STREAM_TIERS] = {{0, 80}, {480, 70}, {320, 50}, {160, 40}};
+
+struct StreamTierEncoder {
+    std::mutex mutex;
+    std::shared_ptr<const JpegFrame> frames[STREAM_TIERS];
+    std::atomic<int> viewers[STREAM_TIERS];   // 只编码有人观看的档位
+    std::atomic<int> source_width{0};
+    std::atomic<int> notify_fd{-1};
+
+    std::shared_ptr<const JpegFrame> get(int tier) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return frames[tier];
+    }
+
+    void encode(const std::vector<uchar>& jpeg, uint64_t seq) {
+        // 原始宽度直接从SOF读出：缩小解码的宽度向上取整，乘回去不一定等于原宽，来源换分辨率时也能立即跟上
+        int width = 0, height = 0;
+        if (!jpeg_frame_size(jpeg, width, height)) return;
+        source_width = width;
+
+        int needed_width = 0;
+        for (int t = 1; t < STREAM_TIERS; t++) {
+            if (viewers[t] > 0) needed_width = std::max(needed_width, stream_tier_ladder[t].width);
+        }
+        if (needed_width == 0) return;
+
+        // 尽量让解码器直接输出缩小的图像，省去大部分IDCT和缩放开销
+        int flags = cv::IMREAD_COLOR;
+        if (width >= needed_width * 4) {
+            flags = cv::IMREAD_REDUCED_COLOR_4;
+        } else if (width >= needed_width * 2) {
+            flags = cv::IMREAD_REDUCED_COLOR_2;
+        }
+        cv::Mat image = cv::imdecode(jpeg, flags);
+        if (image.empty()) return;
+
+        for (int t = 1; t < STREAM_TIERS; t++) {
+            if (viewers[t] <= 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                frames[t].reset();
+                continue;
+            }
+            const StreamTier& tier = stream_tier_ladder[t];
+            cv::Mat scaled = image;
+            if (image.cols > tier.width) {
+                cv::resize(image, scaled, cv::Size(tier.width, image.rows * tier.width / image.cols), 0, 0, cv::INTER_AREA);
+            }
+            auto frame = std::make_shared<JpegFrame>();
+            frame->seq = seq;
+            cv::imencode(".jpg", scaled, frame->data, {cv::IMWRITE_JPEG_QUALITY, tier.quality});
+            std::lock_guard<std::mutex> lock(mutex);
+            frames[t] = frame;
+        }
+
+        int fd = notify_fd;
+        if (fd >= 0) {
+            uint64_t one = 1;
+            ssize_t ret = write(fd, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+};
+
+// 一路摄像头：独立的采集线程（绑定CPU核心）、帧环、画质档位、运动检测和录像写入
+// Web服务器、后台任务池和录像清理由所有摄像头共用
+struct Camera {
+    int index = 0;
+    std::string name;
+    std::string source = "rpicam";     // "rpicam" 或 "rpicam<N>"；"pattern" 合成画面；"raw=路径" BGR24 原始帧回放；
+                                        // 否则为MJPEG字节流路径（FIFO或文件，文件读完从头循环）
+    int width = 640;
+    int height = 480;
+    int fps = 20;
+    int core = -1;                      // 采集线程绑定的CPU核心，-1 表示不绑定
+    bool audio = false;                 // 录像是否含音频，由 --audio-cameras 选择（默认第一路）
+    std::string prefix;                 // 录像文件名前缀，第一路为空以兼容已有录像
+    FrameRing ring;
+    StreamTierEncoder tiers;
+    MotionDetector motion;
+    HlsSegmenter hls;                   // 低延迟HLS直播，需要H.264编码
+    std::shared_ptr<const JpegFrame> stream_frame;  // Web线程缓存的最新帧，仅由Web线程访问
+    MkvWriter writer;
+    std::atomic<int> fps_milli{0};      // 最近一秒的采集帧率 ×1000
+    std::atomic<uint64_t> frames_captured{0};
+    std::atomic<bool> capturing{false};     // 来源已就绪并在出画面
+    std::atomic<uint64_t> restarts{0};
+    std::atomic<int64_t> first_frame_ms{-1};  // 最近一次启动到第一帧的时间
+    std::atomic<int64_t> last_outage_ms{0};   // 最近一次中断从最后一帧到恢复出画面的时间
+    std::thread source_thread;          // 合成来源的发送线程
+    std::thread capture_thread;
+    std::thread tier_thread;
+    std::thread motion_thread;
+};
+
+std::vector<std::unique_ptr<Camera>> cameras;
+
+// 按名称或序号查找摄像头，空字符串为第一路
+Camera* find_camera(const std::string& key) {
+    if (cameras.empty()) return nullptr;
+    if (key.empty()) return cameras[0].get();
+    for (const auto& cam : cameras) {
+        if (cam->name == key) return cam.get();
+    }
+    if (std::all_of(key.begin(), key.end(), ::isdigit)) {
+        size_t index = std::atoi(key.c_str());
+        if (index < cameras.size()) return cameras[index].get();
+    }
+    return nullptr;
+}
+
+// 解析 --cameras=名称:来源:宽x高@帧率[:核心],...
+bool parse_camera_list(const std::string& spec) {
+    std::istringstream list(spec);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        std::vector<std::string> fields;
+        std::istringstream parts(item);
+        std::string field;
+        while (std::getline(parts, field, ':')) fields.push_back(field);
+        if (fields.size() < 3) {
+            std::cerr << "✗ 摄像头配置格式错误: " << item << std::endl;
+            return false;
+        }
+        std::unique_ptr<Camera> cam(new Camera());
+        cam->index = cameras.size();
+        cam->name = fields[0];
+        cam->source = fields[1];
+        if (sscanf(fields[2].c_str(), "%dx%d@%d", &cam->width, &cam->height, &cam->fps) != 3 ||
+            cam->width <= 0 || cam->height <= 0 || cam->fps <= 0) {
+            std::cerr << "✗ 摄像头分辨率格式错误: " << fields[2] << std::endl;
+            return false;
+        }
+        if (fields.size() > 3) cam->core = std::atoi(fields[3].c_str());
+        // 名称用作文件名前缀，必须以字母开头，以便与以时间开头的第一路录像区分
+        bool valid = !cam->name.empty() && isalpha((unsigned char)cam->name[0]) &&
+            std::all_of(cam->name.begin(), cam->name.end(), [](char c) { return isalnum((unsigned char)c) || c == '-'; });
+        if (!valid || find_camera(cam->name)) {
+            std::cerr << "✗ 摄像头名称无效或重复: " << cam->name << std::endl;
+            return false;
+        }
+        if (cam->index > 0) cam->prefix = cam->name + "_";
+        cam->audio = cam->index == 0;
+        cameras.push_back(std::move(cam));
+    }
+    return !cameras.empty();
+}
+
+// 解析 --audio-cameras=名称或序号,...（all 表示全部）：同一路声音封装进这些摄像头的录像
+bool select_audio_cameras(const std::string& spec) {
+    for (const auto& cam : cameras) cam->audio = spec == "all";
+    if (spec == "all") return true;
+    std::istringstream list(spec);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        Camera* cam = item.empty() ? nullptr : find_camera(item);
+        if (!cam) {
+            std::cerr << "✗ 音频摄像头不存在: " << item << std::endl;
+            return false;
+        }
+        cam->audio = true;
+    }
+    return true;
+}
+
+// 按画质档位重新编码：只编码有人观看的档位，跟不上时跳帧
+void stream_tier_thread(Camera* cam) {
+    set_thread_name("tier-" + cam->name);
+    std::vector<uchar> jpeg;
+    uint64_t seq = 0;
+    while (running) {
+        if (cam->ring.wait_next(seq, 500) == 0) continue;
+        seq = cam->ring.read_latest(jpeg);
+        if (seq > 0) cam->tiers.encode(jpeg, seq);
+    }
+}
+
+// 运动检测线程：从帧环读取最新JPEG，解码时直接缩小到1/4灰度图，跟不上时自动跳帧
+void motion_detect_thread(Camera* cam) {
+    set_thread_name("motion-" + cam->name);
+    std::vector<uchar> jpeg;
+    uint64_t seq = 0;
+    while (running) {
+        if (cam->ring.wait_next(seq, 500) == 0) continue;
+        seq = cam->ring.read_latest(jpeg);
+        if (seq == 0) continue;
+        cv::Mat gray = cv::imdecode(jpeg, cv::IMREAD_REDUCED_GRAYSCALE_4);
+        cam->motion.update(gray);
+    }
+}
+
+// 按请求的 w/q 选择满足条件的最高档位
+int choose_stream_tier(Camera& cam, int width, int quality) {
+    int source_width = cam.tiers.source_width;
+    for (int t = 0; t < STREAM_TIERS; t++) {
+        int tier_width = t == 0 ? source_width : stream_tier_ladder[t].width;
+        if (width > 0 && tier_width > width) continue;
+        if (quality > 0 && stream_tier_ladder[t].quality > quality) continue;
+        return t;
+    }
+    return STREAM_TIERS - 1;
+}
+
+// 每个新帧只从环形缓冲拷贝一次，由该摄像头的所有观看者共享
+std::shared_ptr<const JpegFrame> latest_stream_frame(Camera& cam, int tier = 0) {
+    if (tier > 0) return cam.tiers.get(tier);
+    uint64_t seq = cam.ring.latest_seq();
+    if (seq > 0 && (!cam.stream_frame || cam.stream_frame->seq < seq)) {
+        auto frame = std::make_shared<JpegFrame>();
+        frame->seq = cam.ring.read_latest(frame->data);
+        if (frame->seq > 0) cam.stream_frame = frame;
+    }
+    return cam.stream_frame;
+}
+
+void set_stream_tier(HttpConnection& conn, int tier) {
+    Camera& cam = *cameras[conn.stream_cam];
+    if (conn.streaming) cam.tiers.viewers[conn.stream_tier]--;
+    conn.stream_tier = tier;
+    cam.tiers.viewers[tier]++;
+}
+
+// 每2秒根据丢帧比例调整档位：丢帧过半降一档，连续10秒不丢帧升一档
+void adapt_stream_tier(HttpConnection& conn, int64_t now_ms) {
+    if (now_ms - conn.stream_window_start < 2000) return;
+    if (conn.stream_offered >= 5) {
+        double drop_ratio = (double)conn.stream_dropped / conn.stream_offered;
+        if (drop_ratio > 0.5 && conn.stream_tier < STREAM_TIERS - 1) {
+            set_stream_tier(conn, conn.stream_tier + 1);
+            conn.stream_good_windows = 0;
+        } else if (drop_ratio < 0.05) {
+            if (conn.stream_tier > conn.stream_best_tier && ++conn.stream_good_windows >= 5) {
+                set_stream_tier(conn, conn.stream_tier - 1);
+                conn.stream_good_windows = 0;
+            }
+        } else {
+            conn.stream_good_windows = 0;
+        }
+    }
+    conn.stream_offered = 0;
+    conn.stream_dropped = 0;
+    conn.stream_window_start = now_ms;
+}
+
+// 观看者该发的下一帧：未到客户端限定的帧间隔或没有新帧时返回空
+std::shared_ptr<const JpegFrame> next_stream_frame(HttpConnection& conn, int64_t now_ms) {
+    if (now_ms - conn.stream_last_ms < conn.stream_interval_ms) return nullptr;
+    std::shared_ptr<const JpegFrame> frame = latest_stream_frame(*cameras[conn.stream_cam], conn.stream_tier);
+    if (!frame || frame->seq <= conn.stream_seq) return nullptr;
+    return frame;
+}
+
+void send_hls_playlist(HttpConnection& conn, HlsSegmenter& hls) {
+    std::string body = hls.playlist();
+    std::ostringstream response;
+    response << "HTTP/1.1 200 OK\r\n";
+    response << "Content-Type: application/vnd.apple.mpegurl\r\n";
+    response << "Content-Length: " << body.length() << "\r\n";
+    response << "Cache-Control: no-cache\r\n";
+    response << "Connection: " << (conn.keep_alive ? "keep-alive" : "close") << "\r\n\r\n" << body;
+    conn.queue(response.str());
+}
+
+// /hls/[摄像头/]live.m3u8、init.mp4、segN.m4s、partN.I.m4s，省略摄像头时为第一路
+void handle_hls_request(HttpConnection& conn, const HttpRequest& req) {
+    std::string name = req.path.substr(5);
+    std::string camera_key;
+    size_t slash = name.find('/');
+    if (slash != std::string::npos) {
+        camera_key = name.substr(0, slash);
+        name = name.substr(slash + 1);
+    }
+    Camera* cam = find_camera(camera_key);
+    if (!cam) {
+        send_http_response(conn, "text/plain; charset=utf-8", "摄像头不存在", 404);
+        return;
+    }
+    HlsSegmenter& hls = cam->hls;
+    if (!hls.enabled) {
+        send_http_response(conn, "text/plain; charset=utf-8", "HLS未启用（需要 --codec=h264）", 404);
+        return;
+    }
+    
+    if (name == "live.m3u8") {
+        long long msn = get_query_int(req.query, "_HLS_msn", -1);
+        long long part = get_query_int(req.query, "_HLS_part", -1);
+        if (msn >= 0 && !hls.ready(msn, part)) {
+            // 阻塞到请求的分段出现，最多等待3个目标时长
+            conn.waiting_playlist = true;
+            conn.wait_cam = cam->index;
+            conn.wait_msn = msn;
+            conn.wait_part = part;
+            conn.wait_deadline = time(nullptr) + (time_t)std::ceil(hls.target_duration * 3);
+            return;
+        }
+        send_hls_playlist(conn, hls);
+        return;
+    }
+    
+    std::vector<std::shared_ptr<const std::string>> parts;
+    long long msn = 0;
+    unsigned long long index = 0;
+    char tail = 0;
+    if (name == "init.mp4") {
+        std::lock_guard<std::mutex> lock(hls.mutex);
+        parts.push_back(hls.init_segment);
+    } else if (sscanf(name.c_str(), "seg%lld.m4%c", &msn, &tail) == 2 && tail == 's') {
+        hls.get_segment(msn, parts);
+    } else if (sscanf(name.c_str(), "part%lld.%llu.m4%c", &msn, &index, &tail) == 3 && tail == 's') {
+        std::shared_ptr<const std::string> part = hls.get_part(msn, index);
+        if (part) parts.push_back(part);
+    }
+    
+    if (parts.empty()) {
+        send_http_response(conn, "text/plain", "Not Found", 404);
+        return;
+    }
+    
+    size_t length = 0;
+    for (const auto& part : parts) length += part->size();
+    std::ostringstream header;
+    header << "HTTP/1.1 200 OK\r\n";
+    header << "Content-Type: video/mp4\r\n";
+    header << "Content-Length: " << length << "\r\n";
+    header << "Cache-Control: max-age=60\r\n";
+    header << "Connection: " << (conn.keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+    conn.queue(header.str());
+    for (const auto& part : parts) conn.queue_shared(part);
+}
+
+// 检查文件名参数，防止访问录像目录之外的文件
+bool is_safe_filename(const std::string& filename) {
+    return !filename.empty() && filename.find("/") == std::string::npos && filename.find("..") == std::string::npos;
+}
+
+void handle_request(HttpConnection& conn, const HttpRequest& req) {
+    if (req.method != "GET") {
+        send_http_response(conn, "text/plain", "Method Not Allowed", 405);
+        return;
+    }
+    
+    if (req.path == "/" || req.path == "/index.html") {
+        if (!index_template.load()) {
+            send_http_response(conn, "text/plain", "Error: index.html not found!");
+            return;
+        }
+        
+        long long free_space = get_free_disk_space(video_dir_global);
+        long long total_space = get_total_disk_space(video_dir_global);
+        long long used_space = total_space - free_space;
+        double usage_percent = (double)used_space / total_space * 100.0;
+        
+        // 只渲染当前页，页面大小与录像总数无关
+        size_t total_files = 0;
+        size_t page_count = std::max<size_t>(1, (recording_catalog.count() + files_page_size - 1) / files_page_size);
+        size_t page = (size_t)std::max(1LL, std::min<long long>(get_query_int(req.query, "page", 1), page_count));
+        std::vector<FileInfo> files = recording_catalog.list((page - 1) * files_page_size, files_page_size, 0, 0, &total_files);
+        
+        std::ostringstream file_rows;
+        for (const auto& file : files) {
+            // 文件名来自录像目录，可能含引号、尖括号等：属性和文本按HTML转义，
+            // onclick 里的JS字符串先按JS转义再按HTML转义，url() 里用百分号编码
+            std::string html_name = html_escape(file.name);
+            std::string js_name = html_escape(json_escape(file.name));
+            std::string url_name = url_encode(file.name);
+            file_rows << "<tr>"
+                      << "<td><div class='thumb' data-file='" << html_name << "' style=\"background-image:url('/thumb?file=" << url_name << "')\""
+                      << " onmousemove='scrubThumb(this, event)' onmouseleave='resetThumb(this)'></div></td>"
+                      << "<td><span class='file-name-link' onclick='downloadFile(\"" << js_name << "\")'>" 
+                      << html_name << "</span></td>"
+                      << "<td>" << format_size(file.size) << "</td>"
+                      << "<td>" << format_time(file.mtime) << "</td>"
+                      << "<td>"
+                      << "<button class='download-btn' onclick='downloadFile(\"" << js_name << "\")'>下载</button> "
+                      << "<button class='delete-btn' onclick='deleteFile(\"" << js_name << "\")'>删除</button>"
+                      << "</td>"
+                      << "</tr>";
+        }
+        
+        std::ostringstream pager;
+        if (page > 1) pager << "<a href='/?page=" << page - 1 << "'>« 上一页</a> ";
+        pager << "<span>第 " << page << " / " << page_count << " 页，共 " << total_files << " 个文件</span>";
+        if (page < page_count) pager << " <a href='/?page=" << page + 1 << "'>下一页 »</a>";
+        
+        std::map<std::string, std::string> values;
+        values["USAGE_PERCENT"] = std::to_string((int)usage_percent);
+        values["FREE_SPACE"] = format_size(free_space);
+        values["TOTAL_SPACE"] = format_size(total_space);
+        values["FILE_ROWS"] = file_rows.str();
+        values["PAGER"] = pager.str();
+        
+        send_http_response(conn, "text/html; charset=utf-8", index_template.render(values));
+    }
+    else if (req.path == "/api/files") {
+        size_t offset = (size_t)std::max(0LL, get_query_int(req.query, "offset", 0));
+        size_t limit = (size_t)std::max(0LL, std::min(get_query_int(req.query, "limit", files_page_size), 1000LL));
+        time_t from = get_query_int(req.query, "from", 0);
+        time_t to = get_query_int(req.query, "to", 0);
+        
+        size_t total = 0;
+        std::vector<FileInfo> files = recording_catalog.list(offset, limit, from, to, &total);
+        
+        std::ostringstream json;
+        json << "{\"total\":" << total << ",\"offset\":" << offset << ",\"limit\":" << limit << ",\"files\":[";
+        for (size_t i = 0; i < files.size(); i++) {
+            if (i > 0) json << ",";
+            std::string camera = recording_camera(files[i].name);
+            if (camera.empty() && !cameras.empty()) camera = cameras[0]->name;
+            json << "{\"name\":\"" << json_escape(files[i].name) << "\",\"size\":" << files[i].size
+                 << ",\"mtime\":" << files[i].mtime << ",\"camera\":\"" << json_escape(camera) << "\"}";
+        }
+        json << "]}";
+        send_http_response(conn, "application/json", json.str());
+    }
+    else if (req.path == "/api/disk") {
+        long long free_space = get_free_disk_space(video_dir_global);
+        long long total_space = get_total_disk_space(video_dir_global);
+        std::ostringstream json;
+        json << "{\"free\":" << free_space << ",\"total\":" << total_space
+             << ",\"used_percent\":" << (total_space > 0 ? (int)((double)(total_space - free_space) / total_space * 100.0) : 0)
+             << ",\"files\":" << recording_catalog.count() << "}";
+        send_http_response(conn, "application/json", json.str());
+    }
+    else if (req.path == "/metrics") {
+        std::ostringstream out;
+        for (MetricFamily* family : metric_registry()) family->render(out);
+        
+        metric_write_header(out, "recorder_capture_fps", "Camera frames per second over the last second", "gauge");
+        for (const auto& cam : cameras) out << "recorder_capture_fps{camera=\"" << cam->name << "\"} " << cam->fps_milli / 1000.0 << "\n";
+        metric_write_header(out, "recorder_stream_clients", "Connected live stream viewers", "gauge");
+        for (const auto& cam : cameras) {
+            int viewers = 0;
+            for (int t = 0; t < STREAM_TIERS; t++) viewers += cam->tiers.viewers[t];
+            out << "recorder_stream_clients{camera=\"" << cam->name << "\"} " << viewers << "\n";
+        }
+        metric_write_gauge(out, "recorder_disk_free_bytes", "Free space on the recording filesystem", get_free_disk_space(video_dir_global));
+        metric_write_gauge(out, "recorder_disk_total_bytes", "Size of the recording filesystem", get_total_disk_space(video_dir_global));
+        metric_write_gauge(out, "recorder_recordings", "Recordings in the catalog", recording_catalog.count());
+        
+        // 各类后台任务按状态计数，queued 即排队深度
+        std::map<std::pair<std::string, std::string>, int> job_counts;
+        for (const Job& job : job_scheduler.snapshot()) job_counts[{job.type, job.state}]++;
+        metric_write_header(out, "recorder_jobs", "Background jobs by type and state", "gauge");
+        for (const char* type : {"merge", "downsample"}) {
+            for (const char* state : {"queued", "running", "done", "failed"}) {
+                out << "recorder_jobs{type=\"" << type << "\",state=\"" << state << "\"} " << job_counts[{type, state}] << "\n";
+            }
+        }
+        
+        metric_write_gauge(out, "recorder_storage_queue_bytes", "Bytes waiting for the segment writer thread", storage_writer.backlog());
+        metric_write_header(out, "recorder_storage_written_bytes_total", "Bytes written to recording files", "counter");
+        out << "recorder_storage_written_bytes_total " << storage_writer.bytes_written << "\n";
+        metric_write_header(out, "recorder_storage_dropped_clusters_total", "Clusters dropped because storage fell behind", "counter");
+        out << "recorder_storage_dropped_clusters_total " << storage_writer.dropped_clusters << "\n";
+        std::vector<double> bounds;
+        for (int i = 0; i < STORAGE_LATENCY_BUCKETS - 1; i++) bounds.push_back(storage_latency_bounds_ms[i] / 1000.0);
+        std::vector<uint64_t> writes(storage_writer.write_latency.begin(), storage_writer.write_latency.end());
+        metric_write_histogram(out, "recorder_storage_write_seconds", "pwrite latency of the segment writer", bounds, writes,
+                               storage_writer.write_latency_sum_ms / 1000.0);
+        std::vector<uint64_t> syncs(storage_writer.sync_latency.begin(), storage_writer.sync_latency.end());
+        metric_write_histogram(out, "recorder_storage_sync_seconds", "fdatasync latency of the segment writer", bounds, syncs,
+                               storage_writer.sync_latency_sum_ms / 1000.0);
+        
+        if (audio_meter.enabled) {
+            metric_write_gauge(out, "recorder_audio_rms_dbfs", "Audio RMS level of the last 100 ms block", audio_meter.rms_cdb / 100.0);
+            metric_write_gauge(out, "recorder_audio_peak_dbfs", "Audio peak level of the last 100 ms block", audio_meter.peak_cdb / 100.0);
+            metric_write_header(out, "recorder_audio_clipped_samples_total", "Audio samples at full scale", "counter");
+            out << "recorder_audio_clipped_samples_total " << audio_meter.clipped << "\n";
+            metric_write_header(out, "recorder_audio_overruns_total", "Audio blocks dropped because the audio ring was full", "counter");
+            out << "recorder_audio_overruns_total " << audio_ring.overruns << "\n";
+        }
+        send_http_response(conn, "text/plain; version=0.0.4", out.str());
+    }
+    else if (req.path == "/api/audio") {
+        std::ostringstream json;
+        json << "{\"enabled\":" << (audio_meter.enabled ? "true" : "false")
+             << ",\"device\":\"" << json_escape(audio_device) << "\",\"codec\":\"" << json_escape(audio_codec)
+             << "\",\"sample_rate\":" << audio_sample_rate
+             << ",\"rms_db\":" << audio_meter.rms_cdb / 100.0 << ",\"peak_db\":" << audio_meter.peak_cdb / 100.0
+             << ",\"clipped\":" << audio_meter.clipped << ",\"overruns\":" << audio_ring.overruns
+             << ",\"backlog\":" << audio_ring.backlog()
+             << ",\"loud\":" << (audio_meter.loud(1000) ? "true" : "false");
+        if (audio_meter.loudness_trigger) json << ",\"threshold_db\":" << audio_meter.loudness_threshold_db;
+        json << "}";
+        send_http_response(conn, "application/json", json.str());
+    }
+    else if (req.path == "/api/storage") {
+        auto histogram = [](std::ostringstream& out, const std::array<std::atomic<uint64_t>, STORAGE_LATENCY_BUCKETS>& counts) {
+            out << "{\"le\":[";
+            for (int i = 0; i < STORAGE_LATENCY_BUCKETS - 1; i++) out << (i > 0 ? "," : "") << storage_latency_bounds_ms[i];
+            out << "],\"counts\":[";
+            for (int i = 0; i < STORAGE_LATENCY_BUCKETS; i++) out << (i > 0 ? "," : "") << counts[i].load();
+            out << "]}";
+        };
+        std::ostringstream json;
+        json << "{\"direct_io\":" << (storage_writer.direct_io ? "true" : "false")
+             << ",\"chunk_size\":" << storage_writer.chunk_size
+             << ",\"queue_bytes\":" << storage_writer.backlog()
+             << ",\"queue_limit\":" << storage_writer.max_queue_bytes
+             << ",\"queue_peak\":" << storage_writer.queue_peak
+             << ",\"write_rate\":" << storage_writer.write_rate
+             << ",\"bytes_written\":" << storage_writer.bytes_written
+             << ",\"writes\":" << storage_writer.writes
+             << ",\"syncs\":" << storage_writer.syncs
+             << ",\"errors\":" << storage_writer.errors
+             << ",\"dropped_clusters\":" << storage_writer.dropped_clusters
+             << ",\"dropped_bytes\":" << storage_writer.dropped_bytes
+             << ",\"write_latency_ms\":";
+        histogram(json, storage_writer.write_latency);
+        json << ",\"sync_latency_ms\":";
+        histogram(json, storage_writer.sync_latency);
+        json << "}";
+        send_http_response(conn, "application/json", json.str());
+    }
+    else if (req.path == "/api/cameras") {
+        std::ostringstream json;
+        json << "{\"cameras\":[";
+        for (size_t i = 0; i < cameras.size(); i++) {
+            const Camera& cam = *cameras[i];
+            int viewers = 0;
+            for (int t = 0; t < STREAM_TIERS; t++) viewers += cam.tiers.viewers[t];
+            if (i > 0) json << ",";
+            json << "{\"name\":\"" << json_escape(cam.name) << "\",\"width\":" << cam.width
+                 << ",\"height\":" << cam.height << ",\"fps\":" << cam.fps << ",\"core\":" << cam.core
+                 << ",\"capture_fps\":" << cam.fps_milli / 1000.0
+                 << ",\"capturing\":" << (cam.capturing ? "true" : "false")
+                 << ",\"restarts\":" << cam.restarts << ",\"first_frame_ms\":" << cam.first_frame_ms
+                 << ",\"last_outage_ms\":" << cam.last_outage_ms
+                 << ",\"motion\":" << (cam.motion.active(1000) ? "true" : "false")
+                 << ",\"viewers\":" << viewers << "}";
+        }
+        json << "]}";
+        send_http_response(conn, "application/json", json.str());
+    }
+    else if (req.path == "/api/events") {
+        time_t from = get_query_int(req.query, "from", 0);
+        time_t to = get_query_int(req.query, "to", 0);
+        size_t limit = (size_t)std::max(0LL, std::min(get_query_int(req.query, "limit", 100), 1000LL));
+        std::vector<MotionEvent> events = motion_events.list(from, to, limit);
+        
+        std::ostringstream json;
+        bool motion = false;
+        for (const auto& cam : cameras) motion = motion || cam->motion.active(1000);
+        json << "{\"motion\":" << (motion ? "true" : "false") << ",\"events\":[";
+        for (size_t i = 0; i < events.size(); i++) {
+            if (i > 0) json << ",";
+            json << "{\"start\":" << events[i].start << ",\"end\":" << events[i].end
+                 << ",\"peak\":" << events[i].peak_permille / 10.0
+                 << ",\"file\":\"" << json_escape(events[i].file)
+                 << "\",\"kind\":\"" << events[i].kind << "\"}";
+        }
+        json << "]}";
+        send_http_response(conn, "application/json", json.str());
+    }
+    else if (req.path == "/api/jobs") {
+        std::vector<Job> jobs = job_scheduler.snapshot();
+        std::ostringstream json;
+        json << "{\"workers\":" << job_scheduler.workers.size() << ",\"jobs\":[";
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (i > 0) json << ",";
+            json << "{\"id\":" << jobs[i].id << ",\"type\":\"" << json_escape(jobs[i].type)
+                 << "\",\"state\":\"" << jobs[i].state << "\",\"priority\":" << jobs[i].priority
+                 << ",\"progress\":" << jobs[i].progress
+                 << ",\"output\":\"" << json_escape(jobs[i].output.substr(jobs[i].output.rfind('/') + 1))
+                 << "\",\"created\":" << jobs[i].created << ",\"finished\":" << jobs[i].finished << "}";
+        }
+        json << "]}";
+        send_http_response(conn, "application/json", json.str());
+    }
+    else if (req.path == "/download") {
+        std::string filename = get_query_param(req.query, "file");
+        if (is_safe_filename(filename)) {
+            std::string filepath = video_dir_global + "/" + filename;
+            send_file_download(conn, req, filepath, filename);
+        } else {
+            send_http_response(conn, "text/plain", "File not found", 404);
+        }
+    }
+    else if (req.path == "/clip") {
+        // /clip?from=&to=[&cam=]：截取任意时间段，跨录像文件拼接，边读边以分块传输发送
+        time_t from = parse_clip_time(get_query_param(req.query, "from"));
+        time_t to = parse_clip_time(get_query_param(req.query, "to"));
+        if (from < 0 || to <= from || to - from > 24 * 3600) {
+            send_http_response(conn, "text/plain; charset=utf-8", "参数错误：需要 from < to，且不超过24小时", 400);
+            return;
+        }
+        Camera* cam = find_camera(get_query_param(req.query, "cam"));
+        if (!cam) {
+            send_http_response(conn, "text/plain", "Camera not found", 404);
+            return;
+        }
+        auto clip = std::make_shared<ClipProducer>();
+        if (!clip->prepare(from, to, cam->index > 0 ? cam->name : "")) {
+            send_http_response(conn, "text/plain; charset=utf-8", "该时间段没有录像", 404);
+            return;
+        }
+        char name[64];
+        std::strftime(name, sizeof(name), "clip_%Y-%m-%d_%H-%M-%S.mkv", std::localtime(&from));
+        std::ostringstream header;
+        header << "HTTP/1.1 200 OK\r\n";
+        header << "Content-Type: video/x-matroska\r\n";
+        header << "Content-Disposition: attachment; filename=\"" << name << "\"\r\n";
+        header << "Transfer-Encoding: chunked\r\n";
+        header << "Connection: " << (conn.keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+        conn.queue(header.str());
+        conn.clip = clip;
+    }
+    else if (req.path == "/thumb") {
+        // /thumb?file=X 缩略图；&sprite=1 拖动预览雪碧图；&sprite=meta 雪碧图布局
+        std::string filename = get_query_param(req.query, "file");
+        std::string sprite = get_query_param(req.query, "sprite");
+        if (!is_safe_filename(filename)) {
+            send_http_response(conn, "text/plain", "Not Found", 404);
+        } else if (sprite == "meta") {
+            send_file_download(conn, req, thumbnail_cache.meta_path(filename), filename, "application/json");
+        } else if (!sprite.empty()) {
+            send_file_download(conn, req, thumbnail_cache.sprite_path(filename), filename, "image/jpeg");
+        } else {
+            send_file_download(conn, req, thumbnail_cache.thumb_path(filename), filename, "image/jpeg");
+        }
+    }
+    else if (req.path == "/delete") {
+        std::string filename = get_query_param(req.query, "file");
+        if (is_safe_filename(filename)) {
+            std::string filepath = video_dir_global + "/" + filename;
+            if (remove(filepath.c_str()) == 0) {
+                recording_catalog.remove(filename);
+                send_http_response(conn, "text/plain; charset=utf-8", "删除成功！");
+            } else {
+                send_http_response(conn, "text/plain; charset=utf-8", "删除失败");
+            }
+        } else {
+            send_http_response(conn, "text/plain; charset=utf-8", "删除失败", 400);
+        }
+    }
+    else if (req.path.compare(0, 5, "/hls/") == 0) {
+        handle_hls_request(conn, req);
+    }
+    else if (req.path == "/stream") {
+        // /stream?cam=名称或序号，默认第一路
+        Camera* cam = find_camera(get_query_param(req.query, "cam"));
+        if (!cam) {
+            send_http_response(conn, "text/plain", "Camera not found", 404);
+            return;
+        }
+        conn.keep_alive = false;
+        
+        std::ostringstream response;
+        response << "HTTP/1.1 200 OK\r\n";
+        response << "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n";
+        response << "Cache-Control: no-cache\r\n";
+        response << "Connection: close\r\n\r\n";
+        conn.queue(response.str());
+        
+        // /stream?w=320&q=50&fps=5：w/q 选择起始档位（也是升档上限），fps 限制帧率
+        int width = get_query_int(req.query, "w", 0);
+        int quality = get_query_int(req.query, "q", 0);
+        int max_fps = get_query_int(req.query, "fps", 0);
+        conn.stream_interval_ms = max_fps > 0 ? 1000 / max_fps : 0;
+        conn.stream_cam = cam->index;
+        conn.stream_best_tier = choose_stream_tier(*cam, width, quality);
+        conn.stream_window_start = steady_ms();
+        set_stream_tier(conn, conn.stream_best_tier);
+        conn.streaming = true;
+        
+        std::shared_ptr<const JpegFrame> frame = next_stream_frame(conn, steady_ms());
+        if (frame) {
+            conn.queue_frame(frame);
+            conn.stream_last_ms = steady_ms();
+        }
+    }
+    else {
+        send_http_response(conn, "text/plain", "Not Found", 404);
+    }
+}
+
+// 基于epoll的单线程事件循环：非阻塞套接字、keep-alive、每连接独立的发送队列
+struct HttpServer {
+    int server_sock = -1;
+    int epfd = -1;
+    int frame_fd = -1;
+    int hls_fd = -1;
+    std::unordered_map<int, std::unique_ptr<HttpConnection>> conns;
+
+    void update_events(HttpConnection& conn, bool want_write) {
+        if (conn.epollout == want_write) return;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.fd = conn.fd;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.epollout = want_write;
+    }
+
+    void close_connection(int fd) {
+        auto it = conns.find(fd);
+        if (it == conns.end()) return;
+        HttpConnection& conn = *it->second;
+        if (conn.file_fd >= 0) close(conn.file_fd);
+        if (conn.streaming) cameras[conn.stream_cam]->tiers.viewers[conn.stream_tier]--;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        conns.erase(it);
+    }
+
+    void accept_clients() {
+        while (true) {
+            struct sockaddr_in client_addr;
+            socklen_t client_len = sizeof(client_addr);
+            int client_sock = accept4(server_sock, (struct sockaddr*)&client_addr, &client_len,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_sock < 0) return;
+            
+            if ((int)conns.size() >= http_max_connections) {
+                const char* busy = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                send(client_sock, busy, strlen(busy), MSG_NOSIGNAL);
+                close(client_sock);
+                continue;
+            }
+            
+            std::unique_ptr<HttpConnection> conn(new HttpConnection());
+            conn->fd = client_sock;
+            conn->last_active = time(nullptr);
+            
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = client_sock;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev) != 0) {
+                close(client_sock);
+                continue;
+            }
+            conns[client_sock] = std::move(conn);
+        }
+    }
+
+    // 解析缓冲区中的完整请求；上一个响应发送完之前不处理下一个（流水线请求按序处理）
+    void process_requests(HttpConnection& conn) {
+        while (!conn.busy() && !conn.streaming) {
+            size_t head_end = conn.in_buf.find("\r\n\r\n");
+            if (head_end == std::string::npos) {
+                if (conn.in_buf.size() > 16 * 1024) {
+                    conn.keep_alive = false;
+                    send_http_response(conn, "text/plain", "Request Header Fields Too Large", 431);
+                    conn.in_buf.clear();
+                }
+                return;
+            }
+            
+            HttpRequest req;
+            bool ok = parse_http_request(conn.in_buf.substr(0, head_end), req);
+            
+            // 丢弃请求体（只支持GET）
+            size_t body_len = 0;
+            std::string content_length = get_header(req, "content-length");
+            if (!content_length.empty()) body_len = std::strtoull(content_length.c_str(), nullptr, 10);
+            if (conn.in_buf.size() < head_end + 4 + body_len) return;
+            conn.in_buf.erase(0, head_end + 4 + body_len);
+            
+            if (!ok) {
+                conn.keep_alive = false;
+                send_http_response(conn, "text/plain", "Bad Request", 400);
+                return;
+            }
+            
+            std::string connection = get_header(req, "connection");
+            std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+            if (req.version == "HTTP/1.0") {
+                conn.keep_alive = connection == "keep-alive";
+            } else {
+                conn.keep_alive = connection != "close";
+            }
+            
+            uint64_t begin_ns = metric_now_ns();
+            handle_request(conn, req);
+            metric_http_request.observe_since(begin_ns);
+            metric_http_requests.add();
+        }
+    }
+
+    // 尽可能多地发送队列中的数据，返回false表示连接已关闭
+    bool flush(HttpConnection& conn) {
+        while (true) {
+            if (conn.out_queue.empty() && conn.file_remaining > 0) {
+                // 响应头发完后用 sendfile 直接从页缓存发送文件，不经过用户态缓冲
+                off_t offset = conn.file_offset;
+                size_t chunk = (size_t)std::min<long long>(conn.file_remaining, 4 * 1024 * 1024);
+                ssize_t n = sendfile(conn.fd, conn.file_fd, &offset, chunk);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        update_events(conn, true);
+                        return true;
+                    }
+                    if (errno == EINTR) continue;
+                }
+                if (n <= 0) {
+                    // 出错或文件被截断，无法补齐Content-Length，只能断开
+                    close_connection(conn.fd);
+                    return false;
+                }
+                conn.last_active = time(nullptr);
+                metric_http_sent_bytes.add(n);
+                conn.file_offset += n;
+                conn.file_remaining -= n;
+                if (conn.file_remaining == 0) {
+                    close(conn.file_fd);
+                    conn.file_fd = -1;
+                }
+                continue;
+            }
+            
+            if (conn.out_queue.empty() && conn.clip) {
+                // 上一块发完后才读取下一块，发送速度决定读盘速度
+                std::string data;
+                bool more = conn.clip->next(data);
+                if (!data.empty()) {
+                    std::ostringstream chunk_size;
+                    chunk_size << std::hex << data.size() << "\r\n";
+                    conn.queue(chunk_size.str());
+                    conn.queue(std::move(data));
+                    conn.queue("\r\n");
+                }
+                if (!more) {
+                    conn.queue("0\r\n\r\n");
+                    conn.clip.reset();
+                }
+                continue;
+            }
+            
+            if (conn.out_queue.empty()) break;
+            
+            OutChunk& chunk = conn.out_queue.front();
+            ssize_t n = send(conn.fd, chunk.data + conn.out_offset, chunk.len - conn.out_offset, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    update_events(conn, true);
+                    return true;
+                }
+                if (errno == EINTR) continue;
+                close_connection(conn.fd);
+                return false;
+            }
+            conn.last_active = time(nullptr);
+            metric_http_sent_bytes.add(n);
+            conn.out_offset += n;
+            conn.out_bytes -= n;
+            if (conn.out_offset == chunk.len) {
+                conn.out_queue.pop_front();
+                conn.out_offset = 0;
+            }
+        }
+        
+        // 观看者发送完上一帧后立即补发最新帧，慢速客户端只会跳帧而不会积压
+        if (conn.streaming) {
+            int64_t now_ms = steady_ms();
+            std::shared_ptr<const JpegFrame> frame = next_stream_frame(conn, now_ms);
+            if (frame) {
+                conn.queue_frame(frame);
+                conn.stream_last_ms = now_ms;
+                return flush(conn);
+            }
+            update_events(conn, false);
+            return true;
+        }
+        
+        update_events(conn, false);
+        if (conn.waiting_playlist) return true;
+        if (!conn.keep_alive) {
+            close_connection(conn.fd);
+            return false;
+        }
+        
+        if (!conn.in_buf.empty()) {
+            process_requests(conn);
+            if (conn.busy()) return flush(conn);
+        }
+        return true;
+    }
+
+    void on_readable(HttpConnection& conn) {
+        char buffer[4096];
+        while (true) {
+            ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                // /stream 连接之后发来的数据直接丢弃
+                if (!conn.streaming) conn.in_buf.append(buffer, n);
+                conn.last_active = time(nullptr);
+                if (conn.in_buf.size() > 64 * 1024) {
+                    close_connection(conn.fd);
+                    return;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            close_connection(conn.fd);
+            return;
+        }
+        
+        process_requests(conn);
+        if (conn.busy()) flush(conn);
+    }
+
+    // 新帧到达：只给发送队列已清空的观看者推送
+    void broadcast_frame() {
+        uint64_t count;
+        while (read(frame_fd, &count, sizeof(count)) > 0) {}
+        
+        // 到期的帧若上一帧还没发完则直接跳过并计入丢帧，用于自适应降档
+        int64_t now_ms = steady_ms();
+        std::vector<std::pair<int, std::shared_ptr<const JpegFrame>>> ready;
+        for (auto& item : conns) {
+            HttpConnection& conn = *item.second;
+            if (!conn.streaming) continue;
+            std::shared_ptr<const JpegFrame> frame = next_stream_frame(conn, now_ms);
+            if (frame && frame->seq > conn.stream_last_offered) {
+                conn.stream_last_offered = frame->seq;
+                conn.stream_offered++;
+                if (conn.out_bytes == 0) {
+                    ready.push_back({conn.fd, frame});
+                    metric_stream_frames_sent.add();
+                } else {
+                    conn.stream_dropped++;
+                    metric_stream_frames_dropped.add();
+                }
+            }
+            adapt_stream_tier(conn, now_ms);
+        }
+        for (const auto& item : ready) {
+            auto it = conns.find(item.first);
+            if (it == conns.end()) continue;
+            it->second->queue_frame(item.second);
+            it->second->stream_last_ms = now_ms;
+            flush(*it->second);
+        }
+    }
+
+    // 有新的HLS部分分段：回应已满足条件（或已超时）的阻塞播放列表请求
+    void wake_playlist_waiters(bool drain) {
+        if (drain) {
+            uint64_t count;
+            while (read(hls_fd, &count, sizeof(count)) > 0) {}
+        }
+        
+        time_t now = time(nullptr);
+        std::vector<int> ready;
+        for (auto& item : conns) {
+            HttpConnection& conn = *item.second;
+            if (conn.waiting_playlist &&
+                (now >= conn.wait_deadline || cameras[conn.wait_cam]->hls.ready(conn.wait_msn, conn.wait_part))) {
+                ready.push_back(conn.fd);
+            }
+        }
+        for (int fd : ready) {
+            auto it = conns.find(fd);
+            if (it == conns.end()) continue;
+            HttpConnection& conn = *it->second;
+            conn.waiting_playlist = false;
+            conn.last_active = now;
+            send_hls_playlist(conn, cameras[conn.wait_cam]->hls);
+            flush(conn);
+        }
+    }
+
+    // 关闭长时间无数据往来的连接
+    void close_idle_connections() {
+        time_t now = time(nullptr);
+        std::vector<int> idle;
+        for (auto& item : conns) {
+            HttpConnection& conn = *item.second;
+            // 等待新帧的观看者和阻塞中的播放列表请求不算空闲
+            if (conn.streaming && conn.out_bytes == 0) continue;
+            if (conn.waiting_playlist) continue;
+            if (now - conn.last_active > http_idle_timeout_sec) idle.push_back(item.first);
+        }
+        for (int fd : idle) close_connection(fd);
+    }
+
+    void run() {
+        server_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (server_sock < 0) return;
+        
+        int opt = 1;
+        setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(http_port);
+        
+        if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            std::cerr << "✗ Web服务器端口绑定失败: " << http_port << std::endl;
+            close(server_sock);
+            return;
+        }
+        
+        listen(server_sock, http_backlog);
+        
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        frame_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        hls_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = server_sock;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, server_sock, &ev);
+        ev.data.fd = frame_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, frame_fd, &ev);
+        ev.data.fd = hls_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, hls_fd, &ev);
+        for (const auto& cam : cameras) {
+            cam->ring.notify_fd = frame_fd;
+            cam->tiers.notify_fd = frame_fd;
+            cam->hls.notify_fd = hls_fd;
+        }
+        
+        std::cout << "✓ Web服务器: http://0.0.0.0:" << http_port << std::endl;
+        
+        struct epoll_event events[64];
+        time_t last_sweep = time(nullptr);
+        while (running) {
+            int n = epoll_wait(epfd, events, 64, 1000);
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == server_sock) {
+                    accept_clients();
+                    continue;
+                }
+                if (fd == frame_fd) {
+                    broadcast_frame();
+                    continue;
+                }
+                if (fd == hls_fd) {
+                    wake_playlist_waiters(true);
+                    continue;
+                }
+                
+                auto it = conns.find(fd);
+                if (it == conns.end()) continue;
+                HttpConnection& conn = *it->second;
+                
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    close_connection(fd);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    if (!flush(conn)) continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                    on_readable(conn);
+                }
+            }
+            
+            if (time(nullptr) != last_sweep) {
+                last_sweep = time(nullptr);
+                close_idle_connections();
+                wake_playlist_waiters(false);
+            }
+        }
+        
+        for (const auto& cam : cameras) {
+            cam->ring.notify_fd = -1;
+            cam->tiers.notify_fd = -1;
+            cam->hls.notify_fd = -1;
+        }
+        while (!conns.empty()) close_connection(conns.begin()->first);
+        close(frame_fd);
+        close(hls_fd);
+        close(epfd);
+        close(server_sock);
+    }
+};
+
+void web_server_thread() {
+    set_thread_name("web");
+    HttpServer server;
+    server.run();
+}
+
+// 录像设置，所有摄像头共用
+struct RecordSettings {
+    bool mjpeg_passthrough = true;      // 原样转存摄像头输出的JPEG，不解码、不叠加时间戳
+    std::string codec = "mjpeg";        // mjpeg（直接转存）、h264（自动选择）或指定编码器名
+    int bitrate = 1500000;
+    int gop = 0;                        // 关键帧间隔（帧），0 表示2秒
+    bool motion_mode = false;           // 只在检测到运动时录制，带预录和延时
+    int64_t pre_roll_ms = 5000;
+    int64_t post_roll_ms = 10000;
+    int record_duration_sec = 3600;     // 1小时
+    bool hls = true;                    // 低延迟HLS直播，每路摄像头各一路，需要H.264编码
+    int sync_interval_ms = 5000;
+    bool audio = false;                 // 音频设备已打开，录像是否含音频还看各路的 Camera::audio
+};
+
+RecordSettings record_settings;
+
+// 测试用摄像头来源：代替 rpicam-vid 往套接字里写 MJPEG，采集端的读取和解析路径与真摄像头相同
+// pattern：合成画面（移动的方块和帧号），预先编码一秒的帧循环发送；raw=路径：BGR24 原始帧文件循环回放
+void synthetic_source_thread(Camera* cam, int fd) {
+    set_thread_name("src-" + cam->name);
+    bool raw = cam->source.compare(0, 4, "raw=") == 0;
+    std::ifstream raw_file;
+    std::vector<uchar> raw_buf((size_t)cam->width * cam->height * 3);
+    std::vector<std::vector<uchar>> pattern;
+    if (raw) {
+        raw_file.open(cam->source.substr(4), std::ios::binary);
+    } else {
+        int box = std::max(16, cam->height / 6);
+        for (int i = 0; i < cam->fps; i++) {
+            cv::Mat image(cam->height, cam->width, CV_8UC3, cv::Scalar(60, 60, 60));
+            int x = (cam->width - box) * i / cam->fps;
+            cv::rectangle(image, cv::Rect(x, (cam->height - box) / 2, box, box), cv::Scalar(40, 200, 240), cv::FILLED);
+            cv::putText(image, cam->name + " #" + std::to_string(i), cv::Point(10, cam->height - 20),
+                        cv::FONT_HERSHEY_SIMPLEX, 0.8, cv::Scalar(255, 255, 255), 2);
+            std::vector<uchar> jpeg;
+            cv::imencode(".jpg", image, jpeg, {cv::IMWRITE_JPEG_QUALITY, 80});
+            pattern.push_back(std::move(jpeg));
+        }
+    }
+    std::vector<uchar> jpeg;
+    int64_t start_ms = steady_ms();
+    for (uint64_t n = 0; running; n++) {
+        if (raw) {
+            if (!raw_file.read((char*)raw_buf.data(), raw_buf.size())) {
+                raw_file.clear();
+                raw_file.seekg(0);
+                if (!raw_file.read((char*)raw_buf.data(), raw_buf.size())) {
+                    std::cerr << "✗ 原始帧文件不足一帧: " << cam->source << std::endl;
+                    break;
+                }
+            }
+            cv::Mat image(cam->height, cam->width, CV_8UC3, raw_buf.data());
+            cv::imencode(".jpg", image, jpeg, {cv::IMWRITE_JPEG_QUALITY, 80});
+        }
+        const std::vector<uchar>& frame = raw ? jpeg : pattern[n % pattern.size()];
+        // 采集端关闭后写入失败，线程随之退出
+        size_t done = 0;
+        while (done < frame.size()) {
+            ssize_t sent = send(fd, frame.data() + done, frame.size() - done, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) break;
+            done += sent;
+        }
+        if (done < frame.size()) break;
+        int64_t wait_ms = start_ms + (int64_t)((n + 1) * 1000 / cam->fps) - steady_ms();
+        if (wait_ms > 0) usleep(wait_ms * 1000);
+    }
+    close(fd);
+}
+
+// 打开摄像头的MJPEG字节流：rpicam 来源启动 rpicam-vid 输出到管道；pattern/raw 来源由发送线程写入套接字
+int open_camera_source(Camera& cam, pid_t& pid) {
+    pid = -1;
+    if (cam.source == "pattern" || cam.source.compare(0, 4, "raw=") == 0) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) return -1;
+        cam.source_thread = std::thread(synthetic_source_thread, &cam, fds[1]);
+        return fds[0];
+    }
+    // FIFO 以非阻塞方式打开：没有写入端时不会卡在 open()，由首帧超时和退避重试处理
+    if (cam.source.compare(0, 6, "rpicam") != 0) return open(cam.source.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+
+    // rpicam-vid 输出到标准输出，经管道读取：不用等它创建输出，子进程退出时读到 EOF
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return -1;
+    fcntl(fds[0], F_SETPIPE_SZ, 1024 * 1024);
+    std::string camera_number = cam.source.substr(6);
+    std::string width = std::to_string(cam.width);
+    std::string height = std::to_string(cam.height);
+    std::string fps = std::to_string(cam.fps);
+    pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        if (camera_number.empty()) {
+            execlp("rpicam-vid", "rpicam-vid", "-t", "0", "--codec", "mjpeg", "--width", width.c_str(),
+                   "--height", height.c_str(), "--framerate", fps.c_str(), "-o", "-", (char*)NULL);
+        } else {
+            execlp("rpicam-vid", "rpicam-vid", "-t", "0", "--camera", camera_number.c_str(), "--codec", "mjpeg",
+                   "--width", width.c_str(), "--height", height.c_str(), "--framerate", fps.c_str(),
+                   "-o", "-", (char*)NULL);
+        }
+        _exit(1);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    return fds[0];
+}
+
+// 采集来源看护：收到第一帧才算就绪，监视子进程和帧间隔，出错时重启来源（指数退避）
+// 重启期间录像文件保持打开、Web服务照常，中断结束后继续写入同一段录像
+int capture_stall_ms = 3000;                // 超过这么久没有新帧视为卡死（低帧率时至少5个帧间隔）
+int capture_first_frame_timeout_ms = 10000; // 启动后这么久仍没有第一帧视为启动失败
+
+struct CaptureSupervisor {
+    Camera& cam;
+    int fd = -1;
+    pid_t pid = -1;
+    bool file_source = false;
+    bool ready = false;                 // 本次启动后已收到第一帧
+    int64_t started_ms = 0;
+    int64_t last_frame_ms = 0;          // 0 表示从未收到过画面
+    int64_t outage_start_ms = 0;        // 中断前最后一帧的时刻，0 表示没有中断
+    int64_t next_start_ms = 0;
+    int backoff_ms = 500;
+
+    explicit CaptureSupervisor(Camera& camera) : cam(camera) {}
+
+    bool start() {
+        ready = false;
+        started_ms = steady_ms();
+        fd = open_camera_source(cam, pid);
+        if (fd < 0) return false;
+        // 普通文件作为模拟摄像头：按帧率放慢读取，读完从头循环
+        struct stat st;
+        file_source = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (!file_source) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return true;
+    }
+
+    void stop() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            int status;
+            bool exited = false;
+            for (int i = 0; i < 20 && !exited; i++) {
+                exited = waitpid(pid, &status, WNOHANG) == pid;
+                if (!exited) usleep(50000);
+            }
+            if (!exited) {
+                kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
+            }
+        }
+        pid = -1;
+        if (cam.source_thread.joinable()) cam.source_thread.join();
+        cam.capturing = false;
+    }
+
+    void fail(const std::string& reason) {
+        // 退出时合成来源先停止发送，不算故障
+        if (!running) {
+            stop();
+            return;
+        }
+        std::cerr << "✗ 摄像头 " << cam.name << " " << reason << "，" << backoff_ms << " 毫秒后重启" << std::endl;
+        if (outage_start_ms == 0 && last_frame_ms > 0) outage_start_ms = last_frame_ms;
+        stop();
+        cam.restarts++;
+        metric_capture_restarts.add();
+        next_start_ms = steady_ms() + backoff_ms;
+        backoff_ms = std::min(backoff_ms * 2, 30000);
+    }
+
+    void frame_arrived(int64_t now_ms) {
+        last_frame_ms = now_ms;
+        if (!ready) {
+            ready = true;
+            cam.capturing = true;
+            cam.first_frame_ms = now_ms - started_ms;
+            metric_capture_first_frame.observe_ns((now_ms - started_ms) * 1000000ULL);
+            std::cout << "✓ 摄像头就绪: " << cam.name << "（首帧 " << now_ms - started_ms << " 毫秒）" << std::endl;
+            if (outage_start_ms > 0) {
+                cam.last_outage_ms = now_ms - outage_start_ms;
+                metric_capture_outage.observe_ns((now_ms - outage_start_ms) * 1000000ULL);
+                std::cout << "✓ 摄像头已恢复: " << cam.name << "，中断 " << now_ms - outage_start_ms << " 毫秒" << std::endl;
+                outage_start_ms = 0;
+            }
+        }
+        // 稳定运行一段时间后退避从头计
+        if (now_ms - started_ms >= 10000) backoff_ms = 500;
+    }
+
+    // 检查子进程和帧间隔，出错时停止来源并安排重启
+    void check() {
+        int status;
+        if (pid > 0 && waitpid(pid, &status, WNOHANG) == pid) {
+            pid = -1;
+            fail(WIFEXITED(status) ? "rpicam-vid 已退出（" + std::to_string(WEXITSTATUS(status)) + "）"
+                                   : "rpicam-vid 被信号 " + std::to_string(WTERMSIG(status)) + " 终止");
+            return;
+        }
+        int64_t now = steady_ms();
+        if (!ready && now - started_ms > capture_first_frame_timeout_ms) {
+            fail("启动后没有画面");
+        } else if (ready && now - last_frame_ms > std::max(capture_stall_ms, 5 * 1000 / cam.fps)) {
+            fail("画面中断 " + std::to_string(now - last_frame_ms) + " 毫秒");
+        }
+    }
+};
+
+// 一路摄像头的采集循环：读取MJPEG、叠加时间戳、发布到帧环、编码并写入录像
+void camera_capture_thread(Camera* cam) {
+    set_thread_name("cap-" + cam->name);
+    const RecordSettings& settings = record_settings;
+    std::string camera_key = cam->index > 0 ? cam->name : "";
+    if (cam->core >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cam->core % CPU_SETSIZE, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            std::cerr << "✗ 无法绑定CPU核心 " << cam->core << ": " << cam->name << std::endl;
+        }
+    }
+
+    std::cout << "→ 启动摄像头 " << cam->name << " (" << cam->source << ", " << cam->width << "x" << cam->height
+              << "@" << cam->fps << ")..." << std::endl;
+    CaptureSupervisor source(*cam);
+    if (!source.start()) source.fail("无法打开");
+
+    int fps = cam->fps;
+    int width = cam->width;
+    int height = cam->height;
+    TimestampOverlay overlay;
+
+    H264Encoder encoder;
+    bool use_h264 = false;
+    if (settings.codec != "mjpeg") {
+        use_h264 = encoder.open(h264_encoder_candidates(settings.codec), width, height, fps, settings.bitrate,
+                                settings.gop > 0 ? settings.gop : fps * 2);
+        if (!use_h264) std::cerr << "✗ 没有可用的H.264编码器，使用MJPEG录制: " << cam->name << std::endl;
+    }
+
+    size_t pre_roll_frames = settings.pre_roll_ms * fps / 1000;
+    std::deque<VideoPacket> pre_roll;
+    MotionEvent current_event;
+    bool event_active = false;
+
+    // 低延迟HLS直播与录像共用同一路H.264编码
+    bool hls_wanted = settings.hls;
+    bool hls_started = false;
+    if (hls_wanted && !use_h264) std::cerr << "✗ 没有H.264编码，HLS直播已跳过: " << cam->name << std::endl;
+
+    MkvWriter& writer = cam->writer;
+    writer.sync_interval_ms = settings.sync_interval_ms;
+    bool with_audio = settings.audio && cam->audio;
+    JpegStreamParser parser;
+    std::vector<uchar> jpeg;
+    std::vector<uchar> read_buf(64 * 1024);
+    std::vector<VideoPacket> packets;
+    std::string video_filename;
+
+    auto start_time = std::chrono::steady_clock::now();
+    std::string thumb_segment;
+    int64_t next_thumb_ms = 0;
+    uint64_t read_ns = 0;                // 读到当前帧为止花在 read/解析上的时间，不含等待
+    int64_t fps_window_start = steady_ms();
+    int fps_window_frames = 0;
+    int64_t next_frame_ms = steady_ms();
+
+    while (running) {
+        uint64_t step_ns = metric_now_ns();
+        bool got_frame = source.fd >= 0 && parser.next_frame(jpeg);
+        read_ns += metric_now_ns() - step_ns;
+        if (!got_frame) {
+            if (source.fd < 0) {
+                // 退避时间到后重启来源，上次残留的半帧丢弃
+                if (steady_ms() < source.next_start_ms) {
+                    usleep(20000);
+                    continue;
+                }
+                parser = JpegStreamParser();
+                if (!source.start()) source.fail("无法打开");
+                continue;
+            }
+            struct pollfd pfd = {source.fd, POLLIN, 0};
+            if (poll(&pfd, 1, 100) > 0) {
+                ssize_t n = read(source.fd, read_buf.data(), read_buf.size());
+                if (n == 0 && source.file_source) {
+                    lseek(source.fd, 0, SEEK_SET);
+                } else if (n == 0) {
+                    source.fail("输出已结束");
+                    continue;
+                } else if (n > 0) {
+                    step_ns = metric_now_ns();
+                    parser.feed(read_buf.data(), n);
+                    read_ns += metric_now_ns() - step_ns;
+                }
+            }
+            source.check();
+            continue;
+        }
+        if (source.file_source) {
+            next_frame_ms += 1000 / fps;
+            int64_t wait_ms = next_frame_ms - steady_ms();
+            if (wait_ms > 0) usleep(wait_ms * 1000);
+            else if (wait_ms < -1000) next_frame_ms = steady_ms();
+        }
+        // 整帧读到的时刻作为采集时间戳，录像按它封装而不是按标称帧率计数
+        int64_t frame_ms = steady_ms();
+        source.frame_arrived(frame_ms);
+        metric_frame_read.observe_ns(read_ns);
+        read_ns = 0;
+        metric_frames_captured.add();
+        cam->frames_captured++;
+        fps_window_frames++;
+        int64_t fps_now = steady_ms();
+        if (fps_now - fps_window_start >= 1000) {
+            cam->fps_milli = (int)(fps_window_frames * 1000000LL / (fps_now - fps_window_start));
+            fps_window_start = fps_now;
+            fps_window_frames = 0;
+        }
+        
+        // 只有需要叠加时间戳或H.264编码时才解码
+        cv::Mat frame;
+        if (!settings.mjpeg_passthrough || use_h264) {
+            step_ns = metric_now_ns();
+            frame = cv::imdecode(jpeg, cv::IMREAD_COLOR);
+            metric_frame_decode.observe_since(step_ns);
+            if (frame.empty()) {
+                metric_frames_dropped.add();
+                continue;
+            }
+        }
         
-        if (remove(oldest.c_str()) == 0) {
-            deleted_count++;
-            std::cout << "✓ 删除旧文件: " << oldest << std::endl;
-        } else {
-            break;
+        if (!settings.mjpeg_passthrough) {
+            step_ns = metric_now_ns();
+            overlay.apply(frame);
+            cv::imencode(".jpg", frame, jpeg, {cv::IMWRITE_JPEG_QUALITY, 80});
+            metric_frame_overlay.observe_since(step_ns);
         }
-    }
-}
-
-// 异步合成线程
-void merge_worker_thread() {
-    while (running) {
-        MergeTask task;
-        bool has_task = false;
         
-        {
-            std::lock_guard<std::mutex> lock(merge_queue_mutex);
-            if (!merge_queue.empty()) {
-                task = merge_queue.front();
-                merge_queue.pop();
-                has_task = true;
-                is_merging = true;
+        // 录像和预览共用同一份压缩数据
+        cam->ring.publish(jpeg.data(), jpeg.size());
+        
+        // 每个录像的第一帧和之后每隔 interval 秒的一帧交给缩略图线程
+        if (writer.is_opened()) {
+            std::string segment_name = video_filename.substr(video_filename.rfind('/') + 1);
+            int64_t now_ms = steady_ms();
+            if (segment_name != thumb_segment || now_ms >= next_thumb_ms) {
+                thumbnail_cache.add_frame(segment_name, jpeg);
+                next_thumb_ms = (segment_name != thumb_segment ? now_ms : next_thumb_ms) + thumbnail_cache.interval_sec * 1000LL;
+                thumb_segment = segment_name;
             }
         }
         
-        if (has_task) {
-            std::cout << "\n→ [异步合成] 开始合并: " << task.output_file << std::endl;
-            
-            // 构建ffmpeg命令
-            std::string ffmpeg_cmd = "ffmpeg -y -i " + task.video_file + 
-                                    " -i " + task.audio_file + 
-                                    " -c:v copy -c:a aac -strict experimental " + 
-                                    task.output_file + " > /dev/null 2>&1";
-            
-            int result = std::system(ffmpeg_cmd.c_str());
-            
-            if (result == 0 && access(task.output_file.c_str(), F_OK) == 0) {
-                std::cout << "✓ [异步合成] 合并成功: " << task.output_file << std::endl;
-                
-                // 删除原始文件
-                remove(task.video_file.c_str());
-                remove(task.audio_file.c_str());
-                std::cout << "✓ [异步合成] 清理临时文件完成" << std::endl;
+        // 记录运动事件的起止；第一路的声音超过响度阈值也算事件
+        bool loud = with_audio && audio_meter.loud(settings.post_roll_ms);
+        bool motion = cam->motion.active(settings.post_roll_ms) || loud;
+        if (motion && !event_active) {
+            current_event = MotionEvent();
+            current_event.start = time(nullptr);
+            event_active = true;
+            if (!cam->motion.active(settings.post_roll_ms)) {
+                current_event.kind = "sound";
+                std::cout << "→ 检测到声音: " << cam->name << std::endl;
             } else {
-                std::cerr << "✗ [异步合成] 合并失败，保留原始文件" << std::endl;
+                std::cout << "→ 检测到运动: " << cam->name << std::endl;
             }
-            
-            is_merging = false;
-        } else {
-            sleep(2);
         }
-    }
-}
-
-// 检查并添加未合成的文件到队列
-void check_unmerged_files(const std::string& dir) {
-    std::cout << "\n→ 检查未合成的视频文件..." << std::endl;
-    
-    DIR* d = opendir(dir.c_str());
-    if (!d) return;
-    
-    std::vector<std::string> avi_files;
-    struct dirent* entry;
-    
-    while ((entry = readdir(d)) != nullptr) {
-        if (entry->d_type == DT_REG) {
-            std::string filename = entry->d_name;
-            if (filename.length() > 4 && filename.substr(filename.length() - 4) == ".avi") {
-                avi_files.push_back(filename);
+        if (event_active) {
+            current_event.peak_permille = std::max(current_event.peak_permille, cam->motion.score_permille.load());
+            if (current_event.file.empty() && writer.is_opened()) {
+                current_event.file = video_filename.substr(video_filename.rfind('/') + 1);
+            }
+        }
+        if (!motion && event_active) {
+            current_event.end = time(nullptr) - settings.post_roll_ms / 1000;
+            motion_events.append(current_event);
+            event_active = false;
+            if (settings.motion_mode && writer.is_opened()) {
+                writer.release();
+                retention_manager.set_active(camera_key, "");
+                thumbnail_cache.finish(thumb_segment);
+                std::cout << "✓ 事件录制完成: " << video_filename << std::endl;
             }
         }
-    }
-    closedir(d);
-    
-    int found_count = 0;
-    for (const auto& avi_file : avi_files) {
-        std::string base_name = avi_file.substr(0, avi_file.length() - 4);
-        std::string wav_file = base_name + ".wav";
-        std::string mp4_file = base_name + ".mp4";
         
-        std::string avi_path = dir + "/" + avi_file;
-        std::string wav_path = dir + "/" + wav_file;
-        std::string mp4_path = dir + "/" + mp4_file;
+        // 满1小时后在下一个关键帧处切换文件，H.264 主动请求关键帧；运动模式下由预录缓冲开始新文件
+        int64_t segment_sec = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - start_time).count();
+        bool segment_due = (!writer.is_opened() && !settings.motion_mode) ||
+                           (writer.is_opened() && segment_sec >= settings.record_duration_sec);
+        // 写盘失败（磁盘已满）时立即清理并换新文件，否则这一小时剩下的录像全部丢失
+        // 至少间隔2秒，避免清理跟不上时每帧都新建文件，也避免同一秒内文件名重复
+        if (!segment_due && writer.is_opened() && segment_sec >= 2 && writer.write_failed()) {
+            std::cerr << "✗ 录像写入失败（磁盘已满？），清理后切换新文件: " << video_filename << std::endl;
+            segment_due = true;
+        }
         
-        // 检查是否存在对应的wav文件，且不存在mp4文件
-        if (access(wav_path.c_str(), F_OK) == 0 && access(mp4_path.c_str(), F_OK) != 0) {
-            MergeTask task;
-            task.video_file = avi_path;
-            task.audio_file = wav_path;
-            task.output_file = mp4_path;
+        packets.clear();
+        if (use_h264) {
+            step_ns = metric_now_ns();
+            encoder.encode(frame, segment_due, frame_ms, packets);
+            for (auto& packet : packets) {
+                if (packet.capture_ms == 0) packet.capture_ms = frame_ms;
+            }
+            metric_frame_encode.observe_since(step_ns);
+        } else {
+            packets.push_back({std::move(jpeg), true, frame_ms});
+        }
+        
+        for (const auto& packet : packets) {
+            // SPS/PPS 在第一个关键帧之后才一定可用
+            if (use_h264 && hls_wanted && !hls_started && packet.keyframe) {
+                cam->hls.start(width, height, fps, encoder.avcc());
+                hls_started = true;
+                std::cout << "✓ HLS直播: http://0.0.0.0:" << http_port << "/hls/" << cam->name << "/live.m3u8"
+                          << (cam->index == 0 ? "（或 /hls/live.m3u8）" : "") << std::endl;
+            }
+            if (hls_started) cam->hls.add(packet);
             
-            std::lock_guard<std::mutex> lock(merge_queue_mutex);
-            merge_queue.push(task);
-            found_count++;
+            // 运动模式下未录制时只缓存最近 pre_roll 秒的压缩帧，始终从关键帧开始
+            if (settings.motion_mode && !writer.is_opened()) {
+                pre_roll.push_back(packet);
+                while (!pre_roll.empty() && !pre_roll.front().keyframe) pre_roll.pop_front();
+                while (true) {
+                    size_t next_key = 1;
+                    while (next_key < pre_roll.size() && !pre_roll[next_key].keyframe) next_key++;
+                    if (next_key >= pre_roll.size() || pre_roll.size() - next_key < pre_roll_frames) break;
+                    pre_roll.erase(pre_roll.begin(), pre_roll.begin() + next_key);
+                }
+                if (!motion || pre_roll.empty()) continue;
+                segment_due = true;
+            }
             
-            std::cout << "  + 发现未合成文件: " << avi_file << std::endl;
+            if (segment_due && (packet.keyframe || !pre_roll.empty())) {
+                if (writer.is_opened()) {
+                    writer.release();
+                    thumbnail_cache.finish(thumb_segment);
+                    std::cout << "✓ 录制完成: " << video_filename << std::endl;
+                }
+                
+                retention_manager.trigger();
+                
+                std::time_t t = std::time(nullptr);
+                char buf[64];
+                std::strftime(buf, sizeof(buf), "%Y-%m-%d_%H-%M-%S", std::localtime(&t));
+                
+                video_filename = video_dir_global + "/" + cam->prefix + std::string(buf) +
+                                 (settings.motion_mode ? "_motion.mkv" : ".mkv");
+                
+                writer.open(video_filename, width, height, fps,
+                            use_h264 ? "V_MPEG4/ISO/AVC" : "V_MJPEG",
+                            use_h264 ? encoder.avcc() : std::vector<uchar>(),
+                            with_audio ? audio_sample_rate : 0, audio_channels,
+                            pre_roll.empty() ? packet.capture_ms : pre_roll.front().capture_ms);
+                
+                if (!writer.is_opened()) {
+                    std::cerr << "✗ 无法创建视频文件！" << std::endl;
+                    sleep(5);
+                    break;
+                }
+                
+                retention_manager.set_active(camera_key, video_filename);
+                std::cout << "\n✓ 开始录制: " << video_filename << std::endl;
+                start_time = std::chrono::steady_clock::now();
+                segment_due = false;
+                
+                if (!pre_roll.empty()) {
+                    for (const auto& buffered : pre_roll) writer.write_video(buffered.data, buffered.keyframe, buffered.capture_ms);
+                    pre_roll.clear();
+                    continue;
+                }
+            }
+            step_ns = metric_now_ns();
+            writer.write_video(packet.data, packet.keyframe, packet.capture_ms);
+            metric_frame_write.observe_since(step_ns);
         }
     }
-    
-    if (found_count > 0) {
-        std::cout << "✓ 找到 " << found_count << " 个未合成文件，已加入队列" << std::endl;
-    } else {
-        std::cout << "✓ 没有发现未合成的文件" << std::endl;
-    }
-}
 
-std::string url_decode(const std::string& str) {
-    std::string result;
-    for (size_t i = 0; i < str.length(); i++) {
-        if (str[i] == '%' && i + 2 < str.length()) {
-            int value;
-            std::istringstream is(str.substr(i + 1, 2));
-            if (is >> std::hex >> value) {
-                result += static_cast<char>(value);
-                i += 2;
-            } else {
-                result += str[i];
-            }
-        } else if (str[i] == '+') {
-            result += ' ';
-        } else {
-            result += str[i];
-        }
+    source.stop();
+    if (event_active) {
+        current_event.end = time(nullptr);
+        motion_events.append(current_event);
     }
-    return result;
+    writer.release();
+    encoder.close();
+    if (!thumb_segment.empty()) thumbnail_cache.finish(thumb_segment);
 }
 
-std::string read_file(const std::string& filepath) {
-    std::ifstream file(filepath);
-    if (!file.is_open()) return "";
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    return buffer.str();
+// 基准测试：无界面运行完整流水线（采集→叠加→编码→录像→直播），预热后统计各环节耗时、帧率和各线程CPU
+// 来源用 pattern/raw/MJPEG 文件和 sine/wav，录像可写到 /dev/null，直播由进程内的观看端拉流
+struct BenchSnapshot {
+    int64_t ms = 0;
+    std::map<std::string, uint64_t> thread_cpu_ns;      // 按线程名汇总的CPU时间
+    std::vector<std::pair<std::vector<uint64_t>, uint64_t>> stages;
+    std::vector<uint64_t> camera_frames;
+    uint64_t stream_frames = 0;
+    uint64_t stream_dropped = 0;
+    uint64_t storage_bytes = 0;
+    uint64_t storage_dropped = 0;
+};
+
+std::vector<std::pair<const char*, MetricHistogram*>> bench_stages() {
+    return {{"读取解析", &metric_frame_read}, {"JPEG解码", &metric_frame_decode}, {"叠加重编码", &metric_frame_overlay},
+            {"H.264编码", &metric_frame_encode}, {"封装写入", &metric_frame_write}, {"音频编码", &metric_audio_encode}};
 }
 
-std::string replace_placeholder(const std::string& html, const std::string& placeholder, const std::string& value) {
-    std::string result = html;
-    size_t pos = 0;
-    while ((pos = result.find(placeholder, pos)) != std::string::npos) {
-        result.replace(pos, placeholder.length(), value);
-        pos += value.length();
+BenchSnapshot bench_snapshot() {
+    BenchSnapshot snap;
+    snap.ms = steady_ms();
+    DIR* dir = opendir("/proc/self/task");
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (entry->d_name[0] == '.') continue;
+            std::string task = std::string("/proc/self/task/") + entry->d_name;
+            std::string name;
+            std::ifstream comm(task + "/comm");
+            std::getline(comm, name);
+            // schedstat 第一项为纳秒精度的运行时间；没有时退回 stat 中以时钟滴答计的 utime+stime
+            std::ifstream schedstat(task + "/schedstat");
+            uint64_t cpu_ns = 0;
+            if (schedstat >> cpu_ns) {
+                snap.thread_cpu_ns[name] += cpu_ns;
+                continue;
+            }
+            std::ifstream stat_file(task + "/stat");
+            std::string stat((std::istreambuf_iterator<char>(stat_file)), std::istreambuf_iterator<char>());
+            size_t paren = stat.rfind(')');
+            if (paren == std::string::npos) continue;
+            // ")" 之后依次为 state ppid ... utime（第14项）stime（第15项）
+            std::istringstream fields(stat.substr(paren + 2));
+            std::string field;
+            uint64_t ticks = 0;
+            for (int i = 3; i <= 15 && fields >> field; i++) {
+                if (i >= 14) ticks += std::strtoull(field.c_str(), nullptr, 10);
+            }
+            snap.thread_cpu_ns[name] += ticks * 1000000000ULL / sysconf(_SC_CLK_TCK);
+        }
+        closedir(dir);
     }
-    return result;
+    for (const auto& stage : bench_stages()) {
+        snap.stages.emplace_back();
+        stage.second->snapshot(snap.stages.back().first, snap.stages.back().second);
+    }
+    for (const auto& cam : cameras) snap.camera_frames.push_back(cam->frames_captured);
+    snap.stream_frames = metric_stream_frames_sent.total();
+    snap.stream_dropped = metric_stream_frames_dropped.total();
+    snap.storage_bytes = storage_writer.bytes_written;
+    snap.storage_dropped = storage_writer.dropped_clusters;
+    return snap;
 }
 
-void send_http_response(int client_sock, const std::string& content_type, const std::string& body) {
-    std::ostringstream response;
-    response << "HTTP/1.1 200 OK\r\n";
-    response << "Content-Type: " << content_type << "\r\n";
-    response << "Content-Length: " << body.length() << "\r\n";
-    response << "Connection: close\r\n\r\n" << body;
-    
-    std::string resp_str = response.str();
-    send(client_sock, resp_str.c_str(), resp_str.length(), 0);
+// 直方图的近似分位数：返回累计达到 q 的桶上界（毫秒），落在 +Inf 桶时返回 -1
+double bench_quantile_ms(const std::vector<double>& bounds, const std::vector<uint64_t>& counts, double q) {
+    uint64_t total = 0;
+    for (uint64_t c : counts) total += c;
+    uint64_t target = (uint64_t)std::ceil(total * q);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= target) return i < bounds.size() ? bounds[i] * 1000 : -1;
+    }
+    return -1;
 }
 
-void send_file_download(int client_sock, const std::string& filepath, const std::string& filename) {
-    std::ifstream file(filepath, std::ios::binary);
-    if (!file.is_open()) {
-        std::string error_response = "HTTP/1.1 404 Not Found\r\nContent-Length: 14\r\n\r\nFile not found";
-        send(client_sock, error_response.c_str(), error_response.length(), 0);
-        return;
+// 模拟观看端：拉取 /stream 并丢弃数据
+void bench_viewer_thread(std::string camera) {
+    set_thread_name("viewer");
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(http_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval timeout = {0, 500000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for (int attempt = 0; running && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 && attempt < 50; attempt++) {
+        usleep(100000);
     }
-    
-    // 获取文件大小
-    file.seekg(0, std::ios::end);
-    long long file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    
-    // 发送响应头
-    std::ostringstream header;
-    header << "HTTP/1.1 200 OK\r\n";
-    header << "Content-Type: application/octet-stream\r\n";
-    header << "Content-Disposition: attachment; filename=\"" << filename << "\"\r\n";
-    header << "Content-Length: " << file_size << "\r\n";
-    header << "Connection: close\r\n\r\n";
-    
-    std::string header_str = header.str();
-    send(client_sock, header_str.c_str(), header_str.length(), 0);
-    
-    // 发送文件内容
-    char buffer[8192];
-    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
-        send(client_sock, buffer, file.gcount(), 0);
+    std::string request = "GET /stream?cam=" + camera + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) > 0) {
+        std::vector<char> buf(256 * 1024);
+        while (running) {
+            ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) break;
+        }
     }
-    
-    file.close();
+    close(fd);
 }
 
-void handle_client(int client_sock) {
-    char buffer[4096];
-    int bytes_read = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
-    
-    if (bytes_read <= 0) {
-        close(client_sock);
-        return;
-    }
-    
-    buffer[bytes_read] = '\0';
-    std::string request(buffer);
-    
-    if (request.find("GET / ") == 0 || request.find("GET /index.html") == 0) {
-        std::string html = read_file("index.html");
-        if (html.empty()) {
-            send_http_response(client_sock, "text/plain", "Error: index.html not found!");
-            close(client_sock);
-            return;
-        }
-        
-        long long free_space = get_free_disk_space(video_dir_global);
-        long long total_space = get_total_disk_space(video_dir_global);
-        long long used_space = total_space - free_space;
-        double usage_percent = (double)used_space / total_space * 100.0;
-        
-        std::vector<FileInfo> files = get_video_files(video_dir_global);
-        
-        std::ostringstream file_rows;
-        for (const auto& file : files) {
-            file_rows << "<tr>"
-                      << "<td><span class='file-name-link' onclick='downloadFile(\"" << file.name << "\")'>" 
-                      << file.name << "</span></td>"
-                      << "<td>" << format_size(file.size) << "</td>"
-                      << "<td>" << format_time(file.mtime) << "</td>"
-                      << "<td>"
-                      << "<button class='download-btn' onclick='downloadFile(\"" << file.name << "\")'>下载</button> "
-                      << "<button class='delete-btn' onclick='deleteFile(\"" << file.name << "\")'>删除</button>"
-                      << "</td>"
-                      << "</tr>";
-        }
-        
-        html = replace_placeholder(html, "{{USAGE_PERCENT}}", std::to_string((int)usage_percent));
-        html = replace_placeholder(html, "{{FREE_SPACE}}", format_size(free_space));
-        html = replace_placeholder(html, "{{TOTAL_SPACE}}", format_size(total_space));
-        html = replace_placeholder(html, "{{FILE_ROWS}}", file_rows.str());
-        
-        send_http_response(client_sock, "text/html; charset=utf-8", html);
+void bench_thread(int seconds, int viewers) {
+    set_thread_name("bench");
+    std::vector<std::thread> viewer_threads;
+    for (int i = 0; i < viewers; i++) viewer_threads.emplace_back(bench_viewer_thread, cameras[i % cameras.size()]->name);
+
+    // 预热：等编码器、写盘线程和观看端进入稳定状态
+    for (int i = 0; i < 30 && running; i++) usleep(100000);
+    BenchSnapshot begin = bench_snapshot();
+    for (int i = 0; i < seconds * 10 && running; i++) usleep(100000);
+    BenchSnapshot end = bench_snapshot();
+    double wall = (end.ms - begin.ms) / 1000.0;
+    auto thread_cpu = [&](const std::string& name) {
+        auto it = begin.thread_cpu_ns.find(name);
+        uint64_t before = it == begin.thread_cpu_ns.end() ? 0 : it->second;
+        return (end.thread_cpu_ns[name] - before) / 1e9 / wall * 100;
+    };
+
+    char line[160];
+    snprintf(line, sizeof(line), "\n========== 基准测试结果（%.1f 秒）==========", wall);
+    std::cout << line << std::endl;
+    for (size_t i = 0; i < cameras.size(); i++) {
+        const Camera& cam = *cameras[i];
+        double fps = (end.camera_frames[i] - begin.camera_frames[i]) / wall;
+        double busy = thread_cpu("cap-" + cam.name.substr(0, 11));
+        // 采集线程是整条流水线的瓶颈（档位编码与运动检测跟不上时跳帧），按其CPU占用估算可持续的最大帧率
+        snprintf(line, sizeof(line), "摄像头 %s %dx%d@%d：实际 %.1f fps，采集线程CPU %.1f%%，估计最大 %.0f fps",
+                 cam.name.c_str(), cam.width, cam.height, cam.fps, fps, busy, busy > 0 ? fps * 100 / busy : 0.0);
+        std::cout << line << std::endl;
     }
-    else if (request.find("GET /download?") == 0) {
-        size_t pos = request.find("file=");
-        if (pos != std::string::npos) {
-            size_t end = request.find(" ", pos);
-            std::string filename = request.substr(pos + 5, end - pos - 5);
-            filename = url_decode(filename);
-            
-            if (filename.find("/") == std::string::npos && filename.find("..") == std::string::npos) {
-                std::string filepath = video_dir_global + "/" + filename;
-                send_file_download(client_sock, filepath, filename);
-            }
+    snprintf(line, sizeof(line), "%-12s %10s %10s %10s %10s", "环节", "次数", "平均ms", "P50≤ms", "P99≤ms");
+    std::cout << line << std::endl;
+    std::vector<std::pair<const char*, MetricHistogram*>> stages = bench_stages();
+    for (size_t i = 0; i < stages.size(); i++) {
+        std::vector<uint64_t> counts = end.stages[i].first;
+        uint64_t count = 0;
+        for (size_t b = 0; b < counts.size(); b++) {
+            counts[b] -= begin.stages[i].first[b];
+            count += counts[b];
         }
+        if (count == 0) continue;
+        double mean = (end.stages[i].second - begin.stages[i].second) / 1e6 / count;
+        snprintf(line, sizeof(line), "%-12s %10llu %10.3f %10.2f %10.2f", stages[i].first, (unsigned long long)count, mean,
+                 bench_quantile_ms(stages[i].second->bounds, counts, 0.5), bench_quantile_ms(stages[i].second->bounds, counts, 0.99));
+        std::cout << line << std::endl;
     }
-    else if (request.find("GET /delete?") == 0) {
-        size_t pos = request.find("file=");
-        if (pos != std::string::npos) {
-            size_t end = request.find(" ", pos);
-            std::string filename = request.substr(pos + 5, end - pos - 5);
-            filename = url_decode(filename);
-            
-            if (filename.find("/") == std::string::npos && filename.find("..") == std::string::npos) {
-                std::string filepath = video_dir_global + "/" + filename;
-                if (remove(filepath.c_str()) == 0) {
-                    send_http_response(client_sock, "text/plain; charset=utf-8", "删除成功！");
-                } else {
-                    send_http_response(client_sock, "text/plain; charset=utf-8", "删除失败");
-                }
-            }
-        }
+    snprintf(line, sizeof(line), "写盘：%.2f MB/s，丢弃 %llu 簇%s", (end.storage_bytes - begin.storage_bytes) / wall / 1048576,
+             (unsigned long long)(end.storage_dropped - begin.storage_dropped), storage_writer.null_sink ? "（/dev/null）" : "");
+    std::cout << line << std::endl;
+    if (viewers > 0) {
+        snprintf(line, sizeof(line), "直播：%d 个观看端，每端 %.1f 帧/秒，丢帧 %llu", viewers,
+                 (end.stream_frames - begin.stream_frames) / wall / viewers,
+                 (unsigned long long)(end.stream_dropped - begin.stream_dropped));
+        std::cout << line << std::endl;
     }
-    else if (request.find("GET /stream") == 0) {
-        std::ostringstream response;
-        response << "HTTP/1.1 200 OK\r\n";
-        response << "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n";
-        response << "Connection: close\r\n\r\n";
-        
-        std::string resp_str = response.str();
-        send(client_sock, resp_str.c_str(), resp_str.length(), 0);
-        
-        while (running) {
-            cv::Mat frame;
-            {
-                std::lock_guard<std::mutex> lock(frame_mutex);
-                if (current_frame.empty()) {
-                    usleep(50000);
-                    continue;
-                }
-                frame = current_frame.clone();
-            }
-            
-            std::vector<uchar> buf;
-            cv::imencode(".jpg", frame, buf, {cv::IMWRITE_JPEG_QUALITY, 80});
-            
-            std::ostringstream frame_header;
-            frame_header << "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " 
-                        << buf.size() << "\r\n\r\n";
-            
-            std::string header_str = frame_header.str();
-            if (send(client_sock, header_str.c_str(), header_str.length(), 0) <= 0) break;
-            if (send(client_sock, buf.data(), buf.size(), 0) <= 0) break;
-            if (send(client_sock, "\r\n", 2, 0) <= 0) break;
-            
-            usleep(50000);
-        }
+    std::cout << "各线程CPU（100% 为一个核心）：" << std::endl;
+    double total = 0;
+    for (const auto& entry : end.thread_cpu_ns) {
+        double cpu = thread_cpu(entry.first);
+        total += cpu;
+        if (cpu < 0.05) continue;
+        snprintf(line, sizeof(line), "  %-16s %6.1f%%", entry.first.c_str(), cpu);
+        std::cout << line << std::endl;
     }
-    
-    close(client_sock);
+    snprintf(line, sizeof(line), "进程合计 %.1f%%（%u 核）", total, std::thread::hardware_concurrency());
+    std::cout << line << std::endl;
+    std::cout << "========================================" << std::endl;
+
+    running = false;
+    for (auto& viewer : viewer_threads) viewer.join();
 }
 
-void web_server_thread() {
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) return;
+// SIGINT/SIGTERM 只置位退出标志，各线程在循环中检查后依次收尾：写完录像、停止 rpicam-vid
+// 处理一次后恢复默认行为，收尾卡住时再按一次 Ctrl+C 可强制退出
+void handle_exit_signal(int) {
+    running = false;
+}
+
+int main(int argc, char* argv[]) {
+    std::cout << "========================================" << std::endl;
+    std::cout << "  树莓派音频+视频录制监控系统" << std::endl;
+    std::cout << "========================================" << std::endl;
     
-    int opt = 1;
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    std::map<std::string, std::string> options = parse_options(argc, argv);
     
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(6969);
+    struct sigaction exit_action;
+    memset(&exit_action, 0, sizeof(exit_action));
+    exit_action.sa_handler = handle_exit_signal;
+    exit_action.sa_flags = SA_RESETHAND;
+    sigemptyset(&exit_action.sa_mask);
+    sigaction(SIGINT, &exit_action, nullptr);
+    sigaction(SIGTERM, &exit_action, nullptr);
     
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        close(server_sock);
-        return;
+    // 基准测试模式（--bench=秒数）：默认合成画面和正弦波，录像写到 /dev/null，跑完后输出报告并退出
+    int bench_seconds = options.count("bench") ? std::max(1, std::atoi(options["bench"].c_str())) : 0;
+    
+    const char* home_dir = std::getenv("HOME");
+    std::string default_dir = bench_seconds > 0 ? "/tmp/recorder-bench" : home_dir ? std::string(home_dir) + "/videos" : "";
+    video_dir_global = get_option(options, "video-dir", default_dir);
+    if (video_dir_global.empty()) return -1;
+    // 统一去掉结尾的 /，各处都用 目录 + "/" + 文件名 拼路径，保证同一文件的路径写法一致
+    while (video_dir_global.size() > 1 && video_dir_global.back() == '/') video_dir_global.pop_back();
+    if (!make_dirs(video_dir_global)) {
+        std::cerr << "✗ 无法创建录像目录: " << video_dir_global << " (" << strerror(errno) << ")" << std::endl;
+        return -1;
     }
+    http_port = std::atoi(get_option(options, "port", std::to_string(http_port)).c_str());
     
-    listen(server_sock, 5);
-    std::cout << "✓ Web服务器: http://0.0.0.0:6969" << std::endl;
+    index_template.path = "index.html";
     
-    while (running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
-        if (client_sock >= 0) {
-            std::thread(handle_client, client_sock).detach();
+    // 摄像头列表：--cameras=名称:来源:宽x高@帧率[:核心],...，默认单路 rpicam 640x480@20
+    int cores = std::max(1, (int)std::thread::hardware_concurrency());
+    if (!parse_camera_list(get_option(options, "cameras", bench_seconds > 0 ? "cam0:pattern:640x480@20" : "cam0:rpicam:640x480@20"))) return -1;
+    for (const auto& cam : cameras) {
+        if (cam->core < 0) cam->core = cam->index % cores;
+    }
+    
+    // 修复上次断电或崩溃时未关闭的录像
+    recover_segments(video_dir_global);
+    
+    // 建立录像索引并监听目录变化
+    recording_catalog.start_watch(video_dir_global);
+    recording_catalog.load();
+    std::thread catalog_thread(catalog_watch_thread);
+    
+    // 缩略图与预览雪碧图
+    thumbnail_cache.interval_sec = std::max(1, std::atoi(get_option(options, "sprite-interval", "10").c_str()));
+    thumbnail_cache.start(video_dir_global);
+    
+    // 录像保留策略，后台定期清理
+    retention_manager.dir = video_dir_global;
+    retention_manager.policy.max_age_days = std::atoi(get_option(options, "max-age-days", "0").c_str());
+    retention_manager.policy.event_max_age_days = std::atoi(get_option(options, "event-max-age-days", "0").c_str());
+    retention_manager.policy.max_bytes = parse_size(get_option(options, "max-bytes", "0"));
+    retention_manager.policy.min_free_bytes = parse_size(get_option(options, "min-free", "500M"));
+    retention_manager.policy.downsample_after_days = std::atoi(get_option(options, "downsample-after-days", "0").c_str());
+    downsample_bitrate = std::atoi(get_option(options, "downsample-bitrate", "300000").c_str());
+    retention_manager.interval_sec = std::max(5, std::atoi(get_option(options, "retention-interval", "60").c_str()));
+    
+    // 各摄像头的录像总量上限：--camera-max-bytes=名称=10G,...
+    std::istringstream quota_list(get_option(options, "camera-max-bytes", ""));
+    std::string quota;
+    while (std::getline(quota_list, quota, ',')) {
+        size_t eq = quota.find('=');
+        Camera* cam = eq == std::string::npos ? nullptr : find_camera(quota.substr(0, eq));
+        if (!cam) {
+            std::cerr << "✗ 配额对应的摄像头不存在: " << quota << std::endl;
+            continue;
         }
+        retention_manager.camera_max_bytes[cam->index > 0 ? cam->name : ""] = parse_size(quota.substr(eq + 1));
     }
-    close(server_sock);
-}
-
-int main() {
-    std::cout << "========================================" << std::endl;
-    std::cout << "  树莓派音频+视频录制监控系统" << std::endl;
-    std::cout << "========================================" << std::endl;
     
-    const char* home_dir = std::getenv("HOME");
-    if (!home_dir) return -1;
-
-    video_dir_global = std::string(home_dir) + "/videos/";
-    std::system(("mkdir -p " + video_dir_global).c_str());
+    std::thread cleanup_thread(retention_thread);
     
-    // 启动异步合成线程
-    std::thread merge_thread(merge_worker_thread);
+    // 启动后台任务线程池，默认留一个核心给采集
+    job_scheduler.nice_value = std::atoi(get_option(options, "job-nice", "10").c_str());
+    job_scheduler.max_load = std::atof(get_option(options, "job-max-load", std::to_string(cores)).c_str());
+    job_scheduler.load(video_dir_global);
+    job_scheduler.start(std::max(1, std::atoi(get_option(options, "jobs", std::to_string(cores - 1)).c_str())));
     
     // 检查未合成的文件
     check_unmerged_files(video_dir_global);
     
-    if (access("/tmp/camfifo", F_OK) == -1) {
-        std::system("mkfifo /tmp/camfifo");
+    // 录像设置
+    record_settings.mjpeg_passthrough = get_option(options, "overlay", "0") != "1";  // --overlay=1 关闭直通
+    record_settings.codec = get_option(options, "codec", "mjpeg");
+    record_settings.bitrate = std::atoi(get_option(options, "bitrate", "1500000").c_str());
+    record_settings.gop = std::atoi(get_option(options, "gop", "0").c_str());
+    record_settings.motion_mode = get_option(options, "record-mode", "continuous") == "motion";
+    record_settings.pre_roll_ms = std::atoi(get_option(options, "pre-roll", "5").c_str()) * 1000LL;
+    record_settings.post_roll_ms = std::atoi(get_option(options, "post-roll", "10").c_str()) * 1000LL;
+    record_settings.hls = get_option(options, "hls", "1") != "0";
+    // HLS 复用录像的H.264编码，MJPEG录制时在启动阶段明确关闭，而不是让各路采集线程各自跳过
+    if (record_settings.hls && record_settings.codec == "mjpeg") {
+        std::cout << "→ HLS直播需要 --codec=h264，本次未启用（--hls=0 关闭此提示）" << std::endl;
+        record_settings.hls = false;
     }
-    
-    // 启动摄像头（MJPEG for Web preview）
-    std::cout << "→ 启动摄像头..." << std::endl;
-    pid_t cam_pid = fork();
-    if (cam_pid == 0) {
-        execlp("rpicam-vid", "rpicam-vid", "-t", "0",
-               "--codec", "mjpeg", "--width", "640", "--height", "480",
-               "--framerate", "20", "-o", "/tmp/camfifo", (char*)NULL);
-        exit(1);
+    record_settings.sync_interval_ms = std::max(1, std::atoi(get_option(options, "sync-interval", "5").c_str())) * 1000;
+    for (const auto& cam : cameras) {
+        cam->motion.threshold = std::atoi(get_option(options, "motion-threshold", "25").c_str());
+        cam->motion.min_area = std::atof(get_option(options, "motion-area", "0.5").c_str());
+        cam->motion.zones = get_option(options, "motion-zones", "");
     }
+    motion_events.load(video_dir_global);
+    
+    // 录像写盘：大块对齐写入，队列积压超过上限时丢帧而不阻塞采集
+    storage_writer.direct_io = get_option(options, "direct-io", "0") == "1";
+    storage_writer.chunk_size = (size_t)std::max(4, std::atoi(get_option(options, "write-chunk", "1024").c_str())) * 1024;
+    storage_writer.max_queue_bytes = (size_t)std::max(1, std::atoi(get_option(options, "write-queue", "16").c_str())) * 1024 * 1024;
+    storage_writer.null_sink = get_option(options, "sink", bench_seconds > 0 ? "null" : "disk") == "null";
+    
+    // 采集看护：多久没有新帧算卡死、启动后多久没有画面算失败（毫秒）
+    capture_stall_ms = std::max(200, std::atoi(get_option(options, "stall-timeout", "3000").c_str()));
+    capture_first_frame_timeout_ms = std::max(1000, std::atoi(get_option(options, "first-frame-timeout", "10000").c_str()));
+    storage_writer.start();
+    
+    // 进程内采集音频，实时压缩后封装进选定摄像头（默认第一路）的录像文件
+    if (!select_audio_cameras(get_option(options, "audio-cameras", cameras[0]->name))) return -1;
+    audio_device = get_option(options, "audio-device", bench_seconds > 0 ? "sine" : audio_device);
+    audio_codec = get_option(options, "audio-codec", "aac");
+    audio_bitrate = std::atoi(get_option(options, "audio-bitrate", "96000").c_str());
+    if (audio_codec == "opus") audio_sample_rate = 48000;
+    audio_period_frames = audio_sample_rate / 10;
+    audio_ring.init(audio_period_frames, audio_channels);
+    std::string loudness = get_option(options, "loudness-threshold", "");
+    audio_meter.loudness_trigger = !loudness.empty();
+    if (audio_meter.loudness_trigger) audio_meter.loudness_threshold_db = std::atof(loudness.c_str());
+    AudioSource audio_source;
+    bool audio_opened = audio_source.open(audio_device);
+    record_settings.audio = audio_meter.enabled = audio_opened;
+    if (!audio_opened) std::cerr << "✗ 无法打开音频设备，仅录制视频: " << audio_device << std::endl;
+    else std::cout << "✓ 音频: " << audio_device << " " << audio_sample_rate << " Hz, " << audio_codec << std::endl;
     
     std::thread web_thread(web_server_thread);
+    for (const auto& cam : cameras) {
+        cam->tier_thread = std::thread(stream_tier_thread, cam.get());
+        cam->motion_thread = std::thread(motion_detect_thread, cam.get());
+        cam->capture_thread = std::thread(camera_capture_thread, cam.get());
+    }
+    std::thread audio_thread;
+    std::thread audio_process;
+    if (audio_opened) {
+        std::vector<MkvWriter*> audio_writers;
+        for (const auto& cam : cameras) {
+            if (cam->audio) audio_writers.push_back(&cam->writer);
+        }
+        audio_thread = std::thread(audio_capture_thread, &audio_source);
+        audio_process = std::thread(audio_process_thread, audio_writers);
+    }
     
-    sleep(2);
-    cv::VideoCapture cap("/tmp/camfifo");
-    if (!cap.isOpened()) {
-        std::cerr << "✗ 无法打开摄像头！" << std::endl;
-        running = false;
-        kill(cam_pid, SIGTERM);
-        web_thread.join();
-        merge_thread.join();
-        return -1;
+    std::thread bench;
+    if (bench_seconds > 0) {
+        int viewers = std::max(0, std::atoi(get_option(options, "bench-viewers", "1").c_str()));
+        std::cout << "→ 基准测试 " << bench_seconds << " 秒，" << viewers << " 个观看端" << std::endl;
+        bench = std::thread(bench_thread, bench_seconds, viewers);
     }
     
-    std::cout << "✓ 系统就绪！" << std::endl;
+    std::cout << "✓ 系统就绪！" << cameras.size() << " 路摄像头" << std::endl;
     std::cout << "========================================" << std::endl;
     
-    int fps = 20;
-    int width = 640;
-    int height = 480;
-    int record_duration_sec = 3600;  // 1小时
+    // 采集线程只在退出时结束；打不开的摄像头单独退出，不影响其他摄像头
+    for (const auto& cam : cameras) cam->capture_thread.join();
     
-    cv::VideoWriter writer;
-    std::string video_filename;
-    std::string audio_filename;
-    auto start_time = std::chrono::steady_clock::now();
-
-    while (running) {
-        // 开始新的录制
-        if (!writer.isOpened()) {
-            ensure_disk_space(video_dir_global, 500 * 1024 * 1024);
-            
-            std::time_t t = std::time(nullptr);
-            char buf[64];
-            std::strftime(buf, sizeof(buf), "%Y-%m-%d_%H-%M-%S", std::localtime(&t));
-            
-            video_filename = video_dir_global + std::string(buf) + ".avi";
-            audio_filename = video_dir_global + std::string(buf) + ".wav";
-            
-            writer.open(video_filename, cv::VideoWriter::fourcc('M','J','P','G'), 
-                       fps, cv::Size(width, height));
-            
-            if (!writer.isOpened()) {
-                std::cerr << "✗ 无法创建视频文件！" << std::endl;
-                sleep(5);
-                continue;
-            }
-            
-            // 启动音频录制
-            audio_pid = fork();
-            if (audio_pid == 0) {
-                execlp("arecord", "arecord",
-                       "-D", "plughw:CARD=Device,DEV=0",
-                       "-f", "cd",
-                       "-t", "wav",
-                       "-d", "3600",
-                       audio_filename.c_str(),
-                       (char*)NULL);
-                exit(1);
-            }
-            
-            std::cout << "\n✓ 开始录制:" << std::endl;
-            std::cout << "  视频: " << video_filename << std::endl;
-            std::cout << "  音频: " << audio_filename << std::endl;
-            
-            start_time = std::chrono::steady_clock::now();
-        }
-        
-        cv::Mat frame;
-        if (!cap.read(frame) || frame.empty()) {
-            usleep(10000);
-            continue;
-        }
-        
-        // 添加时间戳
-        std::time_t t = std::time(nullptr);
-        char buf[32];
-        std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", std::localtime(&t));
-        cv::putText(frame, buf, cv::Point(10, frame.rows - 10),
-                   cv::FONT_HERSHEY_SIMPLEX, 0.7, cv::Scalar(255, 255, 255), 2);
-        
-        {
-            std::lock_guard<std::mutex> lock(frame_mutex);
-            current_frame = frame.clone();
-        }
-        
-        writer.write(frame);
-        
-        // 检查是否录制满1小时
-        if (std::chrono::duration_cast<std::chrono::seconds>(
-            std::chrono::steady_clock::now() - start_time).count() >= record_duration_sec) {
-            
-            std::cout << "✓ 录制完成，准备异步合成..." << std::endl;
-            writer.release();
-            
-            if (audio_pid > 0) {
-                kill(audio_pid, SIGTERM);
-                waitpid(audio_pid, NULL, 0);
-                audio_pid = -1;
-            }
-            
-            // 等待文件写入完成
-            sleep(2);
-            
-            // 生成MP4文件名
-            std::string mp4_filename = video_filename.substr(0, video_filename.length() - 4) + ".mp4";
-            
-            // 检查音视频文件是否存在
-            if (access(video_filename.c_str(), F_OK) == 0 && 
-                access(audio_filename.c_str(), F_OK) == 0) {
-                
-                // 添加到异步合成队列
-                MergeTask task;
-                task.video_file = video_filename;
-                task.audio_file = audio_filename;
-                task.output_file = mp4_filename;
-                
-                {
-                    std::lock_guard<std::mutex> lock(merge_queue_mutex);
-                    merge_queue.push(task);
-                }
-                
-                std::cout << "✓ 已添加到合成队列: " << mp4_filename << std::endl;
-            } else {
-                std::cerr << "✗ 音频或视频文件缺失，无法合成" << std::endl;
-            }
-        }
-    }
-
     std::cout << "\n→ 关闭系统..." << std::endl;
     running = false;
-    cap.release();
-    writer.release();
+    if (bench.joinable()) bench.join();
     
-    if (cam_pid > 0) kill(cam_pid, SIGTERM);
-    if (audio_pid > 0) kill(audio_pid, SIGTERM);
+    if (audio_thread.joinable()) audio_thread.join();
+    if (audio_process.joinable()) audio_process.join();
+    audio_source.close();
+    for (const auto& cam : cameras) cam->writer.release();
+    storage_writer.stop();
     
     web_thread.join();
-    merge_thread.join();
+    for (const auto& cam : cameras) {
+        cam->tier_thread.join();
+        cam->motion_thread.join();
+    }
+    job_scheduler.stop();
+    thumbnail_cache.stop();
+    retention_manager.stop();
+    cleanup_thread.join();
+    catalog_thread.join();
     std::cout << "✓ 系统已关闭" << std::endl;
     
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+# 生成 rpicam-vid --codec mjpeg -o - 输出格式的测试用MJPEG字节流（只用标准库）
+#
+# 每帧为完整的基线JPEG，段的顺序与 rpicam-vid（libjpeg）输出一致：
+#   SOI, APP0(JFIF), APP1(Exif), DQT, SOF0(4:2:0), DHT, DRI, SOS, 熵编码数据（含 FF00 填充和 RSTn）, EOI
+# 画面为渐变背景上移动的方块，帧与帧之间直接相连，没有容器
+#
+# 用法：python3 make_rpicam_mjpeg.py [输出文件]，默认 rpicam_320x240.mjpeg
+import math
+import struct
+import sys
+
+WIDTH, HEIGHT, FRAMES, QUALITY = 320, 240, 5, 75
+RESTART_INTERVAL = 8    # 每8个MCU插入一个RSTn
+
+# ITU T.81 附录K 的标准量化表和哈夫曼表
+LUMA_Q = [16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+          14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+          18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+          49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99]
+CHROMA_Q = [17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+            24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99] + [99] * 32
+ZIGZAG = [0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+          12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+          35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+          58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63]
+DC_LUMA = ([0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0], list(range(12)))
+DC_CHROMA = ([0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0], list(range(12)))
+AC_LUMA = ([0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D], [
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA])
+AC_CHROMA = ([0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77], [
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA])
+
+
+def scale_table(table):
+    # 与 libjpeg 的 jpeg_set_quality 相同的缩放
+    scale = 5000 // QUALITY if QUALITY < 50 else 200 - QUALITY * 2
+    return [min(255, max(1, (q * scale + 50) // 100)) for q in table]
+
+
+def huffman_codes(table):
+    bits, values = table
+    codes, code, k = {}, 0, 0
+    for length in range(1, 17):
+        for _ in range(bits[length - 1]):
+            codes[values[k]] = (code, length)
+            code += 1
+            k += 1
+        code <<= 1
+    return codes
+
+
+def segment(marker, payload):
+    return struct.pack(">BBH", 0xFF, marker, len(payload) + 2) + payload
+
+
+COS = [[math.cos((2 * x + 1) * u * math.pi / 16) for x in range(8)] for u in range(8)]
+
+
+def fdct(block):
+    out = [0.0] * 64
+    for v in range(8):
+        for u in range(8):
+            s = 0.0
+            for y in range(8):
+                row = block[y * 8:y * 8 + 8]
+                cy = COS[v][y]
+                s += cy * sum(row[x] * COS[u][x] for x in range(8))
+            cu = math.sqrt(0.5) if u == 0 else 1.0
+            cv = math.sqrt(0.5) if v == 0 else 1.0
+            out[v * 8 + u] = 0.25 * cu * cv * s
+    return out
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.nbits = 0
+
+    def write(self, code, length):
+        self.acc = (self.acc << length) | code
+        self.nbits += length
+        while self.nbits >= 8:
+            self.nbits -= 8
+            byte = (self.acc >> self.nbits) & 0xFF
+            self.out.append(byte)
+            if byte == 0xFF:
+                self.out.append(0x00)   # 熵编码数据中的 FF 后补 00
+        self.acc &= (1 << self.nbits) - 1
+
+    def flush(self):
+        if self.nbits:
+            self.write((1 << (8 - self.nbits)) - 1, 8 - self.nbits)
+
+
+def magnitude(value):
+    n = abs(value).bit_length()
+    return n, (value if value >= 0 else value + (1 << n) - 1)
+
+
+def encode_block(writer, block, quant, dc_codes, ac_codes, prev_dc):
+    coeffs = fdct([p - 128 for p in block])
+    zz = [int(round(coeffs[ZIGZAG[i]] / quant[i])) for i in range(64)]
+    diff = zz[0] - prev_dc
+    n, bits = magnitude(diff)
+    writer.write(*dc_codes[n])
+    if n:
+        writer.write(bits, n)
+    run = 0
+    for i in range(1, 64):
+        if zz[i] == 0:
+            run += 1
+            continue
+        while run > 15:
+            writer.write(*ac_codes[0xF0])
+            run -= 16
+        n, bits = magnitude(zz[i])
+        writer.write(*ac_codes[(run << 4) | n])
+        writer.write(bits, n)
+        run = 0
+    if run:
+        writer.write(*ac_codes[0x00])
+    return zz[0]
+
+
+def render(frame):
+    # 渐变背景 + 移动的方块，返回 Y/Cb/Cr 三个平面
+    ys, cbs, crs = [], [], []
+    bx = 20 + frame * 40
+    for y in range(HEIGHT):
+        for x in range(WIDTH):
+            r, g, b = (x * 255) // WIDTH, (y * 255) // HEIGHT, 96
+            if bx <= x < bx + 64 and 88 <= y < 152:
+                r, g, b = 250, 200, 40
+            ys.append(0.299 * r + 0.587 * g + 0.114 * b)
+            cbs.append(128 - 0.168736 * r - 0.331264 * g + 0.5 * b)
+            crs.append(128 + 0.5 * r - 0.418688 * g - 0.081312 * b)
+    return ys, cbs, crs
+
+
+def encode_frame(frame):
+    lq, cq = scale_table(LUMA_Q), scale_table(CHROMA_Q)
+    out = bytearray(b"\xFF\xD8")
+    out += segment(0xE0, b"JFIF\x00\x01\x01\x00\x00\x01\x00\x01\x00\x00")
+    # 最小的 Exif APP1：大端 TIFF 头 + 空的 IFD0
+    out += segment(0xE1, b"Exif\x00\x00MM\x00\x2A\x00\x00\x00\x08\x00\x00\x00\x00\x00\x00")
+    out += segment(0xDB, bytes([0]) + bytes(lq[i] for i in range(64)) + bytes([1]) + bytes(cq[i] for i in range(64)))
+    out += segment(0xC0, struct.pack(">BHHB", 8, HEIGHT, WIDTH, 3) + bytes([1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1]))
+    for cls_id, table in ((0x00, DC_LUMA), (0x10, AC_LUMA), (0x01, DC_CHROMA), (0x11, AC_CHROMA)):
+        out += segment(0xC4, bytes([cls_id]) + bytes(table[0]) + bytes(table[1]))
+    out += segment(0xDD, struct.pack(">H", RESTART_INTERVAL))
+    out += segment(0xDA, bytes([3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0]))
+
+    ys, cbs, crs = render(frame)
+    codes = {"dc0": huffman_codes(DC_LUMA), "ac0": huffman_codes(AC_LUMA),
+             "dc1": huffman_codes(DC_CHROMA), "ac1": huffman_codes(AC_CHROMA)}
+    writer = BitWriter()
+    prev = [0, 0, 0]
+    mcu, restart = 0, 0
+    for my in range(0, HEIGHT, 16):
+        for mx in range(0, WIDTH, 16):
+            if mcu and mcu % RESTART_INTERVAL == 0:
+                writer.flush()
+                writer.out += bytes([0xFF, 0xD0 + restart % 8])
+                restart += 1
+                prev = [0, 0, 0]
+            for by in (0, 8):
+                for bx in (0, 8):
+                    block = [ys[(my + by + y) * WIDTH + mx + bx + x] for y in range(8) for x in range(8)]
+                    prev[0] = encode_block(writer, block, lq, codes["dc0"], codes["ac0"], prev[0])
+            for c, plane in ((1, cbs), (2, crs)):
+                block = []
+                for y in range(8):
+                    for x in range(8):
+                        px, py = mx + 2 * x, my + 2 * y
+                        block.append((plane[py * WIDTH + px] + plane[py * WIDTH + px + 1] +
+                                      plane[(py + 1) * WIDTH + px] + plane[(py + 1) * WIDTH + px + 1]) / 4)
+                prev[c] = encode_block(writer, block, cq, codes["dc1"], codes["ac1"], prev[c])
+            mcu += 1
+    writer.flush()
+    out += writer.out
+    out += b"\xFF\xD9"
+    return bytes(out)
+
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else "rpicam_320x240.mjpeg"
+    with open(path, "wb") as f:
+        for frame in range(FRAMES):
+            f.write(encode_frame(frame))
+
+
+if __name__ == "__main__":
+    main()
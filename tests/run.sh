@@ -0,0 +1,7 @@
+#!/bin/sh
+# 构建并运行单元测试，参数为可选的测试名过滤
+# 链接参数与 md 中的构建命令保持一致
+set -e
+cd "$(dirname "$0")"
+g++ -o recorder_tests test_main.cpp     `pkg-config --cflags --libs opencv4 alsa libavcodec libavutil`     -lpthread -std=c++11
+./recorder_tests "$@"